@@ -1,21 +1,49 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <ctype.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <time.h>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <vector>
 #include <SOIL.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#   include <emmintrin.h>
+#endif
 
 #if _WIN32
 #   include <Windows.h>
+#   include <GL/glew.h>
+#else
+#   include <fcntl.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
 #endif
 #if __APPLE__
 #   include <OpenGL/gl.h>
 #   include <OpenGL/glu.h>
 #   include <GLUT/glut.h>
 #else
+#   define GL_GLEXT_PROTOTYPES
 #   include <GL/gl.h>
 #   include <GL/glu.h>
 #   include <GL/glut.h>
 #endif
+#if !defined(OFFSCREEN_EGL) && !_WIN32 && !__APPLE__
+#   define OFFSCREEN_EGL 1
+#endif
+#if OFFSCREEN_EGL
+#   include <EGL/egl.h>
+#endif
 
 #define ESC 27
 #define SPACEBAR 32
@@ -31,7 +59,6 @@
 #define RANGE_SEA 100.0f
 #define MAX_TESSELLATION 32
 #define MIN_TESSELLATION 4
-#define LENGTH_HEIGHT (MAX_TESSELLATION + 1 + 2 * MAX_TESSELLATION / MIN_TESSELLATION)
 #define MILLI 1000.0f
 #define RATIO 0.4f // define the ratio of unit length drawing normals
 #define WIDTH 800
@@ -64,6 +91,9 @@
 #define BOAT_BALL_VZ float(CANNON_SPEED * cosf(boat[i].cannonAngle) * cosf(boat[i].cangleY))
 #define PARTICLE_NUM 100
 #define PARTICLE_SPEED 100.0f
+#define DIRTY_TESSELLATION 1 // tessellation changed: rebuild geometry and normals
+#define DIRTY_AIM 2 // cannon rotation changed: recompute the island cannonball launch
+#define DIRTY_ALL (DIRTY_TESSELLATION | DIRTY_AIM)
 
 static GLfloat light_pos[] = { 1.0f, 1.0f, 1.0f, 0.0f }; // Position of light
 static GLfloat white[] = { 1.0f, 1.0f, 1.0f, 1.0f };
@@ -74,88 +104,1794 @@ static GLfloat red[] = { 1.0f, 0.0f, 0.0f, 1.0f };
 static GLfloat transRed[] = { 1.0f, 0.0f, 0.0f, 0.6f };
 static GLfloat green[] = { 0.0f, 1.0f, 0.0f, 1.0f };
 
-GLfloat cylinderSideNormals[(MAX_TESSELLATION + 1) * MAX_TESSELLATION * 3];
-GLfloat fortLeftNormals[MAX_TESSELLATION / 2 * 3 + 15], fortRightNormals[MAX_TESSELLATION / 2 * 3 + 15];
-GLfloat islandNormals[(MAX_TESSELLATION + 1) * (MAX_TESSELLATION + 1) * 3];
-GLfloat seaNormals[(MAX_TESSELLATION * 6 + 1) * (MAX_TESSELLATION * 6 + 1) * 3];
-GLfloat seaVertices[(MAX_TESSELLATION * 6 + 1) * (MAX_TESSELLATION * 6 + 1) * 3];
-GLuint textureTerrian, textureSkybox[6];
+GLfloat cylinderSideNormals[(MAX_TESSELLATION + 1) * MAX_TESSELLATION * 3];
+GLfloat fortLeftNormals[MAX_TESSELLATION / 2 * 3 + 15], fortRightNormals[MAX_TESSELLATION / 2 * 3 + 15];
+GLfloat islandNormals[(MAX_TESSELLATION + 1) * (MAX_TESSELLATION + 1) * 3];
+GLfloat islandVertices[(MAX_TESSELLATION + 1) * (MAX_TESSELLATION + 1) * 3];
+GLfloat islandTexcoords[(MAX_TESSELLATION + 1) * (MAX_TESSELLATION + 1) * 2];
+// indices of a w x h vertex grid in any layout (see Index layouts): six per quad, and at most
+// four more per row and three per column of quads for degenerate triangles and restarts
+#define GRID_INDICES_MAX(w, h) (((w) - 1) * ((h) - 1) * 6 + ((h) - 1) * 4 + ((w) - 1) * 3)
+GLuint islandIndices[GRID_INDICES_MAX(MAX_TESSELLATION + 1, MAX_TESSELLATION + 1)];
+int islandIndexCount, islandLayout;
+GLuint seaIndices[MAX_TESSELLATION * MAX_TESSELLATION * 6 * 36];
+GLfloat ballVertices[MAX_TESSELLATION * (MAX_TESSELLATION + 1) * 3];
+GLfloat ballNormals[MAX_TESSELLATION * (MAX_TESSELLATION + 1) * 3];
+GLuint ballIndices[MAX_TESSELLATION * MAX_TESSELLATION * 6];
+// the sea grid is simulation state, one copy per thread like the rest (see Simulation thread)
+#define SEA_GRID_FLOATS ((MAX_TESSELLATION * 6 + 1) * (MAX_TESSELLATION * 6 + 1) * 3)
+thread_local GLfloat seaNormals[SEA_GRID_FLOATS];
+thread_local GLfloat seaVertices[SEA_GRID_FLOATS];
+GLuint textureTerrian, textureSkybox[6];
+unsigned randomSeed = 0; // --seed for the boats and particles, 0 for the time of day
+
+/************************************************************************************************
+ * GL call counters
+ *
+ * The GL calls below this point go through wrappers. The wrappers count batches and the
+ * vertices they submit for the metrics log; a batch is a glBegin() or a glDraw*() call. With
+ * --gl-calls they also count every call by the function it was made in, so the immediate mode
+ * paths can be ranked by the calls they make. The report is printed on quit, worst path
+ * first. The wrappers are macros over the GL names, so the drawing code stays plain GL.
+ *
+ * Building with -DCOUNT_GL_CALLS=0 leaves the GL names alone. Nothing is counted then, and
+ * the metrics log shows no batches or vertices.
+ *************************************************************************************************/
+#ifndef COUNT_GL_CALLS
+#define COUNT_GL_CALLS 1
+#endif
+#define GL_CALL_SITES 64 // functions told apart
+
+enum { GL_CALL_BEGIN, GL_CALL_VERTEX, GL_CALL_NORMAL, GL_CALL_TEXCOORD, GL_CALL_COLOR, GL_CALL_DRAW, GL_CALL_UPLOAD, GL_CALL_NUM };
+
+const char *glCallNames[GL_CALL_NUM] = { "begin", "vertex", "normal", "texcoord", "color", "draw", "upload" };
+
+typedef struct {
+	long batches; // glBegin() and glDraw*() calls this frame
+	long vertices; // vertices submitted this frame
+} drawCount_t;
+
+typedef struct {
+	const char *func; // __func__ of the caller, told apart by address
+	long long calls[GL_CALL_NUM];
+	long long vertices; // vertices submitted, immediate or from arrays
+	long long immediate; // glBegin() and the calls up to its glEnd()
+} glCallSite_t;
+
+typedef struct {
+	bool enabled; // --gl-calls
+	int frames; // frames counted
+	glCallSite_t sites[GL_CALL_SITES];
+	int siteCount;
+	glCallSite_t *last; // the site of the last call, usually the next one's too
+	bool inBegin; // between glBegin() and glEnd()
+} glCalls_t;
+
+drawCount_t drawCount;
+glCalls_t glCalls;
+
+glCallSite_t *glCallSite(const char *func) {
+	for (int k = 0; k < glCalls.siteCount; k++)
+		if (glCalls.sites[k].func == func)
+			return glCalls.last = &glCalls.sites[k];
+	if (glCalls.siteCount == GL_CALL_SITES)
+		return NULL;
+	glCallSite_t *site = &glCalls.sites[glCalls.siteCount++];
+	site->func = func;
+	return glCalls.last = site;
+}
+
+inline void glCallCount(const char *func, int call, long vertices) {
+	if (!glCalls.enabled)
+		return;
+	glCallSite_t *site = glCalls.last && glCalls.last->func == func ? glCalls.last : glCallSite(func);
+	if (!site)
+		return;
+	site->calls[call]++;
+	site->vertices += vertices;
+	if (call == GL_CALL_BEGIN || glCalls.inBegin)
+		site->immediate++;
+}
+
+int compareGlCallSites(const void *a, const void *b) {
+	const glCallSite_t *x = (const glCallSite_t *)a, *y = (const glCallSite_t *)b;
+	return x->immediate != y->immediate ? (x->immediate < y->immediate ? 1 : -1)
+		: x->vertices < y->vertices ? 1 : x->vertices > y->vertices ? -1 : 0;
+}
+
+// print the calls per frame of every function, most immediate mode calls first
+void glCallsReport() {
+	if (!glCalls.enabled || !glCalls.frames)
+		return;
+	qsort(glCalls.sites, glCalls.siteCount, sizeof(glCallSite_t), compareGlCallSites);
+	glCalls.last = NULL;
+	double f = glCalls.frames;
+	printf("GL calls per frame over %d frames\n%-28s %10s %10s", glCalls.frames, "", "immediate", "vertices");
+	for (int c = 0; c < GL_CALL_NUM; c++)
+		printf(" %8s", glCallNames[c]);
+	printf("\n");
+	glCallSite_t total = { "total" };
+	for (int k = 0; k <= glCalls.siteCount; k++) {
+		const glCallSite_t *site = k < glCalls.siteCount ? &glCalls.sites[k] : &total;
+		printf("%-28s %10.1f %10.1f", site->func, site->immediate / f, site->vertices / f);
+		for (int c = 0; c < GL_CALL_NUM; c++) {
+			printf(" %8.1f", site->calls[c] / f);
+			total.calls[c] += site->calls[c];
+		}
+		printf("\n");
+		total.immediate += site->immediate;
+		total.vertices += site->vertices;
+	}
+}
+
+#if COUNT_GL_CALLS
+inline void countedBegin(const char *func, GLenum mode) {
+	drawCount.batches++;
+	glCallCount(func, GL_CALL_BEGIN, 0);
+	glCalls.inBegin = true;
+	glBegin(mode);
+}
+
+inline void countedEnd() {
+	glCalls.inBegin = false;
+	glEnd();
+}
+
+inline void countedVertex3f(const char *func, GLfloat x, GLfloat y, GLfloat z) {
+	drawCount.vertices++;
+	glCallCount(func, GL_CALL_VERTEX, 1);
+	glVertex3f(x, y, z);
+}
+
+inline void countedVertex2i(const char *func, GLint x, GLint y) {
+	drawCount.vertices++;
+	glCallCount(func, GL_CALL_VERTEX, 1);
+	glVertex2i(x, y);
+}
+
+inline void countedNormal3f(const char *func, GLfloat x, GLfloat y, GLfloat z) {
+	glCallCount(func, GL_CALL_NORMAL, 0);
+	glNormal3f(x, y, z);
+}
+
+inline void countedTexCoord2f(const char *func, GLfloat s, GLfloat t) {
+	glCallCount(func, GL_CALL_TEXCOORD, 0);
+	glTexCoord2f(s, t);
+}
+
+inline void countedColor3f(const char *func, GLfloat r, GLfloat g, GLfloat b) {
+	glCallCount(func, GL_CALL_COLOR, 0);
+	glColor3f(r, g, b);
+}
+
+inline void countedColor4f(const char *func, GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+	glCallCount(func, GL_CALL_COLOR, 0);
+	glColor4f(r, g, b, a);
+}
+
+inline void countedDrawElements(const char *func, GLenum mode, GLsizei count, GLenum type, const GLvoid *indices) {
+	drawCount.batches++;
+	drawCount.vertices += count;
+	glCallCount(func, GL_CALL_DRAW, count);
+	glDrawElements(mode, count, type, indices);
+}
+
+inline void countedDrawArrays(const char *func, GLenum mode, GLint first, GLsizei count) {
+	drawCount.batches++;
+	drawCount.vertices += count;
+	glCallCount(func, GL_CALL_DRAW, count);
+	glDrawArrays(mode, first, count);
+}
+
+inline void countedBufferData(const char *func, GLenum target, GLsizeiptr size, const GLvoid *data, GLenum usage) {
+	glCallCount(func, GL_CALL_UPLOAD, 0);
+	glBufferData(target, size, data, usage);
+}
+
+inline void countedTexSubImage2D(const char *func, GLenum target, GLint level, GLint x, GLint y, GLsizei w, GLsizei h, GLenum format, GLenum type, const GLvoid *pixels) {
+	glCallCount(func, GL_CALL_UPLOAD, 0);
+	glTexSubImage2D(target, level, x, y, w, h, format, type, pixels);
+}
+
+#ifdef GL_VERSION_3_3
+inline void countedDrawArraysInstanced(const char *func, GLenum mode, GLint first, GLsizei count, GLsizei instances) {
+	drawCount.batches++;
+	drawCount.vertices += (long)count * instances;
+	glCallCount(func, GL_CALL_DRAW, (long)count * instances);
+	glDrawArraysInstanced(mode, first, count, instances);
+}
+#define glDrawArraysInstanced(mode, first, count, instances) countedDrawArraysInstanced(__func__, mode, first, count, instances)
+#endif
+
+#define glBegin(mode) countedBegin(__func__, mode)
+#define glEnd() countedEnd()
+#define glVertex3f(x, y, z) countedVertex3f(__func__, x, y, z)
+#define glVertex2i(x, y) countedVertex2i(__func__, x, y)
+#define glNormal3f(x, y, z) countedNormal3f(__func__, x, y, z)
+#define glTexCoord2f(s, t) countedTexCoord2f(__func__, s, t)
+#define glColor3f(r, g, b) countedColor3f(__func__, r, g, b)
+#define glColor4f(r, g, b, a) countedColor4f(__func__, r, g, b, a)
+#define glDrawElements(mode, count, type, indices) countedDrawElements(__func__, mode, count, type, indices)
+#define glDrawArrays(mode, first, count) countedDrawArrays(__func__, mode, first, count)
+#define glBufferData(target, size, data, usage) countedBufferData(__func__, target, size, data, usage)
+#define glTexSubImage2D(target, level, x, y, w, h, format, type, pixels) countedTexSubImage2D(__func__, target, level, x, y, w, h, format, type, pixels)
+#endif
+
+/************************************************************************************************
+ * Clock
+ *
+ * Everything that measures time reads one steady clock, clockNs(), counted in nanoseconds from
+ * when the program started; clockSeconds() is the same in seconds. The game runs on a clock of
+ * its own, gameClock_t: the real time since the game started less the time spent paused, times
+ * --time-scale. With --time-step the game clock is virtual instead and every tick moves it on by
+ * the step however long the tick took, so a run can go faster than real time.
+ *
+ * Stopwatches add up the time a subsystem took between two reports. They can be started and
+ * stopped on any thread.
+ *************************************************************************************************/
+typedef struct {
+	long long start; // clockNs() when the game started
+	long long pausedAt; // clockNs() when it was paused, 0 while it runs
+	long long paused; // nanoseconds spent paused
+	double virtualT; // game seconds with --time-step
+} gameClock_t;
+
+typedef struct {
+	double scale; // --time-scale, game seconds per real second
+	double step; // --time-step, game seconds per tick; 0 to follow real time
+	float simMs, renderMs; // the stopwatches as the OSD shows them
+} timing_t;
+
+enum { STOPWATCH_SIM, STOPWATCH_RENDER, STOPWATCH_NUM };
+
+typedef struct {
+	std::atomic<long long> total; // nanoseconds since the last report
+	std::atomic<int> laps;
+	std::atomic<long long> lifetime; // nanoseconds since the program started
+} stopwatch_t;
+
+timing_t timing = { 1.0, 0.0 };
+stopwatch_t stopwatches[STOPWATCH_NUM];
+const std::chrono::steady_clock::time_point clockOrigin = std::chrono::steady_clock::now();
+
+long long clockNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - clockOrigin).count();
+}
+
+double clockSeconds() {
+	return clockNs() * 1e-9;
+}
+
+void gameClockStart(gameClock_t *c) {
+	c->start = clockNs();
+	c->pausedAt = c->paused = 0;
+	c->virtualT = 0.0;
+}
+
+void gameClockPause(gameClock_t *c) {
+	if (!c->pausedAt)
+		c->pausedAt = clockNs();
+}
+
+void gameClockResume(gameClock_t *c) {
+	if (c->pausedAt) {
+		c->paused += clockNs() - c->pausedAt;
+		c->pausedAt = 0;
+	}
+}
+
+// game seconds for a new tick
+double gameClockTick(gameClock_t *c) {
+	if (timing.step > 0.0)
+		return c->virtualT += timing.step;
+	long long now = c->pausedAt ? c->pausedAt : clockNs();
+	return (now - c->start - c->paused) * 1e-9 * timing.scale;
+}
+
+// add the time since start, a clockNs(), to a stopwatch
+void stopwatchStop(int w, long long start) {
+	long long ns = clockNs() - start;
+	stopwatches[w].total += ns;
+	stopwatches[w].lifetime += ns;
+	stopwatches[w].laps++;
+}
+
+// milliseconds per lap since the last call
+float stopwatchTake(int w) {
+	long long total = stopwatches[w].total.exchange(0);
+	int laps = stopwatches[w].laps.exchange(0);
+	return laps ? total * 1e-6f / laps : 0.0f;
+}
+
+/************************************************************************************************
+ * Profiler
+ *
+ * PROFILE_ZONE(name) times the rest of the enclosing block. With --profile every thread records
+ * its zones into a ring of its own, PROFILE_RING deep, that only it writes; a zone costs two
+ * clock reads and one store. Zones nest, and each records how deep it is.
+ *
+ * At the end of every frame profileFrame() adds up the zones finished since the last frame
+ * by name and thread, and the OSD shows the time per frame of each, averaged over the frame rate
+ * interval and indented by depth. 'p', or quitting with --profile-dump, writes the last
+ * profiler.dumpFrames (--profile-frames) frames still in the rings as a Chrome trace for
+ * chrome://tracing or ui.perfetto.dev.
+ *
+ * Building with -DPROFILER=0 compiles the zones out.
+ *************************************************************************************************/
+#ifndef PROFILER
+#define PROFILER 1
+#endif
+#define PROFILE_RING 65536 // zones a thread keeps, a power of two
+#define PROFILE_THREADS 64
+#define PROFILE_FRAMES 1024 // frame starts kept for dumps
+#define PROFILE_SHOWN 24 // zones shown on the OSD
+
+typedef struct {
+	const char *name;
+	long long start, end; // clockNs()
+	int depth;
+} profileEvent_t;
+
+typedef struct {
+	profileEvent_t events[PROFILE_RING];
+	std::atomic<unsigned> head; // events written, only by the owning thread
+	unsigned read; // events added up by profileFrame()
+	int depth; // zones open on the owning thread
+	int thread;
+} profileRing_t;
+
+typedef struct {
+	const char *name;
+	int thread, depth;
+	long long first; // start of the first zone, to show zones in the order they run
+	long long total; // nanoseconds since the last report
+	float ms; // per frame as shown
+} profileTotal_t;
+
+typedef struct {
+	bool enabled; // --profile
+	const char *dumpFilename; // --profile-dump
+	bool dumpOnExit; // write the trace when the game quits
+	int dumpFrames; // --profile-frames
+	std::atomic<profileRing_t *> rings[PROFILE_THREADS]; // NULL until filled in
+	std::atomic<int> ringCount;
+	long long frameStarts[PROFILE_FRAMES];
+	int frames; // frames started
+	profileTotal_t totals[PROFILE_SHOWN];
+	int totalCount;
+} profiler_t;
+
+profiler_t profiler = { false, "profile.json", false, 120 };
+
+#if PROFILER
+thread_local profileRing_t *profileMine;
+
+profileRing_t *profileRing() {
+	if (!profileMine) {
+		int k = profiler.ringCount++;
+		if (k >= PROFILE_THREADS)
+			return NULL;
+		profileMine = new profileRing_t();
+		profileMine->thread = k;
+		profiler.rings[k].store(profileMine, std::memory_order_release);
+	}
+	return profileMine;
+}
+
+typedef struct profileZone_s {
+	profileRing_t *ring;
+	const char *name;
+	long long start;
+	int depth;
+	profileZone_s(const char *zoneName) : ring(NULL), name(zoneName), start(0), depth(0) {
+		if (!profiler.enabled || !zoneName || !(ring = profileRing()))
+			return;
+		depth = ring->depth++;
+		start = clockNs();
+	}
+	~profileZone_s() {
+		if (!ring)
+			return;
+		unsigned head = ring->head.load(std::memory_order_relaxed);
+		profileEvent_t *e = &ring->events[head & (PROFILE_RING - 1)];
+		e->name = name;
+		e->start = start;
+		e->end = clockNs();
+		e->depth = depth;
+		ring->depth--;
+		ring->head.store(head + 1, std::memory_order_release);
+	}
+} profileZone_t;
+
+#define PROFILE_CONCAT(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_CONCAT(profileZone, line)
+#define PROFILE_ZONE(name) profileZone_t PROFILE_NAME(__LINE__)(name)
+
+// mark the start of a frame on the render thread
+void profileFrameStart() {
+	if (profiler.enabled)
+		profiler.frameStarts[profiler.frames++ % PROFILE_FRAMES] = clockNs();
+}
+
+// add up the zones every thread finished since the last frame
+void profileFrame() {
+	if (!profiler.enabled)
+		return;
+	int rings = profiler.ringCount.load();
+	for (int r = 0; r < rings && r < PROFILE_THREADS; r++) {
+		profileRing_t *ring = profiler.rings[r].load(std::memory_order_acquire);
+		if (!ring)
+			continue;
+		unsigned head = ring->head.load(std::memory_order_acquire);
+		if (head - ring->read > PROFILE_RING)
+			ring->read = head - PROFILE_RING;
+		for (; ring->read != head; ring->read++) {
+			const profileEvent_t *e = &ring->events[ring->read & (PROFILE_RING - 1)];
+			profileTotal_t *t = NULL;
+			for (int k = 0; k < profiler.totalCount && !t; k++)
+				if (profiler.totals[k].name == e->name && profiler.totals[k].thread == ring->thread)
+					t = &profiler.totals[k];
+			if (!t && profiler.totalCount < PROFILE_SHOWN) {
+				t = &profiler.totals[profiler.totalCount++];
+				t->name = e->name;
+				t->thread = ring->thread;
+				t->first = 0;
+				t->total = 0;
+				t->ms = 0.0f;
+			}
+			if (!t)
+				continue;
+			if (!t->first)
+				t->first = e->start;
+			t->depth = e->depth;
+			t->total += e->end - e->start;
+		}
+	}
+}
+
+// the time per frame of every zone over the last frames frames, for the OSD
+void profileTake(int frames) {
+	// zones that did not run since the last report make room for new ones
+	int count = 0;
+	for (int k = 0; k < profiler.totalCount; k++) {
+		profileTotal_t *t = &profiler.totals[k];
+		if (!t->total)
+			continue;
+		t->ms = frames ? t->total * 1e-6f / frames : 0.0f;
+		profiler.totals[count++] = *t;
+	}
+	profiler.totalCount = count;
+	// by thread, then in the order the zones first ran
+	for (int k = 1; k < profiler.totalCount; k++) {
+		profileTotal_t t = profiler.totals[k];
+		int j = k;
+		for (; j > 0 && (profiler.totals[j - 1].thread > t.thread
+			|| (profiler.totals[j - 1].thread == t.thread && profiler.totals[j - 1].first > t.first)); j--)
+			profiler.totals[j] = profiler.totals[j - 1];
+		profiler.totals[j] = t;
+	}
+	for (int k = 0; k < profiler.totalCount; k++) {
+		profiler.totals[k].first = 0;
+		profiler.totals[k].total = 0;
+	}
+}
+
+// write the zones of the last profiler.dumpFrames frames as a Chrome trace
+bool profileDump() {
+	if (!profiler.enabled) {
+		printf("Run with --profile to record zones.\n");
+		return false;
+	}
+	int back = profiler.dumpFrames < profiler.frames ? profiler.dumpFrames : profiler.frames;
+	back = back < PROFILE_FRAMES ? back : PROFILE_FRAMES - 1;
+	long long from = back > 0 ? profiler.frameStarts[(profiler.frames - back) % PROFILE_FRAMES] : 0;
+	FILE *f = fopen(profiler.dumpFilename, "w");
+	if (!f) {
+		printf("Failed to write %s.\n", profiler.dumpFilename);
+		return false;
+	}
+	fprintf(f, "{\"traceEvents\":[\n");
+	int count = 0, rings = profiler.ringCount.load();
+	for (int r = 0; r < rings && r < PROFILE_THREADS; r++) {
+		profileRing_t *ring = profiler.rings[r].load(std::memory_order_acquire);
+		if (!ring)
+			continue;
+		// main() takes the first ring
+		if (r == 0)
+			fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}");
+		else
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", r, r);
+		unsigned head = ring->head.load(std::memory_order_acquire);
+		unsigned first = head > PROFILE_RING ? head - PROFILE_RING : 0;
+		for (unsigned i = first; i != head; i++) {
+			const profileEvent_t *e = &ring->events[i & (PROFILE_RING - 1)];
+			if (e->start < from)
+				continue;
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				e->name, r, e->start * 1e-3, (e->end - e->start) * 1e-3);
+			count++;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	printf("Wrote %d zones of %d frames to %s.\n", count, back, profiler.dumpFilename);
+	return true;
+}
+#else
+#define PROFILE_ZONE(name)
+
+void profileFrameStart() {
+}
+
+void profileFrame() {
+}
+
+void profileTake(int frames) {
+}
+
+bool profileDump() {
+	printf("This build has no profiler; build without -DPROFILER=0.\n");
+	return false;
+}
+#endif
+
+/************************************************************************************************
+ * Jobs
+ *
+ * CPU work that can be spread over the cores is cut into jobs for a small work stealing
+ * scheduler. Every thread that runs jobs has a deque of its own: it pushes and pops at the back,
+ * working on what it queued last while that is still in cache, and a thread with nothing to do
+ * steals from the front of the others. jobFor() splits an index range into children of one job
+ * and runs them, returning when they are all done.
+ *
+ * A frame or a tick is laid out as a graph: jobCreate() the jobs, jobAfter() the edges, then
+ * jobRun() them all and jobWait() for the last. Edges are only added before the jobs run.
+ * jobWait() does not block, it runs jobs until the one it waits for is done.
+ *
+ * The game state is thread_local (see Simulation thread), so a job that reads it is pinned to
+ * the thread that created it and never stolen. Everything else captures what it needs by value.
+ * Named jobs add their time to jobStats: busy is the time spent running the job and its
+ * children on all threads, wall the time from being queued to being done.
+ *************************************************************************************************/
+#define JOB_QUEUES 64 // workers plus the threads that queue jobs
+#define JOB_POOL 512 // jobs a thread can have in flight
+#define JOB_DEPENDENTS 4 // jobs that can be after one job
+#define JOB_STATS 16 // named jobs that are timed
+
+typedef struct job_s {
+	const char *name; // NULL for jobs that are not timed, like the children of jobFor()
+	std::function<void()> fn;
+	bool pinned; // only run by the thread that created it
+	int queue; // queue of the thread that created it
+	struct job_s *parent; // gets the time of its children and is done when they are
+	std::atomic<int> unfinished; // the job itself, or its children
+	std::atomic<int> blockers; // jobs it is after, plus one until jobRun()
+	std::atomic<bool> done;
+	struct job_s *dependents[JOB_DEPENDENTS];
+	int dependentCount;
+	std::atomic<long long> busy; // nanoseconds
+	long long queued;
+} job_t;
+
+typedef struct {
+	std::mutex lock;
+	std::deque<job_t *> jobs; // the owner pops at the back, others steal from the front
+	std::deque<job_t *> pinned; // run by the owner only, in order
+} jobQueue_t;
+
+typedef struct {
+	std::atomic<const char *> name;
+	std::atomic<long long> busy, wall; // nanoseconds
+	std::atomic<int> count;
+} jobStat_t;
+
+typedef struct {
+	const char *name;
+	double busy, wall; // milliseconds
+	int count;
+} jobTimes_t;
+
+typedef struct {
+	int workers; // --jobs, -1 for one less than the cores
+	bool timing; // --job-timing shows jobStats on the OSD
+	jobTimes_t shown[JOB_STATS]; // what the OSD shows
+	int shownCount;
+	jobQueue_t *queues;
+	job_t *pool; // JOB_POOL jobs for each queue
+	std::atomic<int> queueCount;
+	std::atomic<int> queued; // jobs that can be stolen
+	std::atomic<int> sleeping;
+	std::mutex *sleepLock;
+	std::condition_variable *wake;
+} jobs_t;
+
+jobs_t jobs = { -1, false, {}, 0 };
+jobStat_t jobStats[JOB_STATS];
+thread_local int jobQueueIndex = -1, jobNext;
+
+// the queue of this thread, claimed the first time it queues a job
+int jobQueue() {
+	if (jobQueueIndex < 0)
+		jobQueueIndex = jobs.queueCount++ % JOB_QUEUES;
+	return jobQueueIndex;
+}
+
+void jobStatAdd(const char *name, long long busy, long long wall) {
+	for (int k = 0; k < JOB_STATS; k++) {
+		const char *empty = NULL;
+		if (jobStats[k].name.load() != name && !jobStats[k].name.compare_exchange_strong(empty, name) && empty != name)
+			continue;
+		jobStats[k].busy += busy;
+		jobStats[k].wall += wall;
+		jobStats[k].count++;
+		return;
+	}
+}
+
+job_t *jobCreate(const char *name, std::function<void()> fn, bool pinned) {
+	int q = jobQueue();
+	job_t *job = &jobs.pool[q * JOB_POOL + jobNext++ % JOB_POOL];
+	job->name = name;
+	job->fn = fn;
+	job->pinned = pinned;
+	job->queue = q;
+	job->parent = NULL;
+	job->unfinished = 1;
+	job->blockers = 1;
+	job->done = false;
+	job->dependentCount = 0;
+	job->busy = 0;
+	return job;
+}
+
+// job runs only once after is done
+void jobAfter(job_t *job, job_t *after) {
+	// a graph is laid out in the code, so one that needs more edges is a bug to fix there
+	if (after->dependentCount == JOB_DEPENDENTS) {
+		printf("Job %s has more than %d jobs after it.\n", after->name ? after->name : "(unnamed)", JOB_DEPENDENTS);
+		abort();
+	}
+	after->dependents[after->dependentCount++] = job;
+	job->blockers++;
+}
+
+void jobPush(job_t *job) {
+	job->queued = clockNs();
+	jobQueue_t *q = &jobs.queues[job->pinned ? job->queue : jobQueue()];
+	{
+		std::lock_guard<std::mutex> guard(q->lock);
+		if (job->pinned)
+			q->pinned.push_back(job);
+		else
+			q->jobs.push_back(job);
+	}
+	if (job->pinned)
+		return;
+	jobs.queued++;
+	if (jobs.sleeping.load() > 0) {
+		// taking the lock makes sure a worker about to sleep sees the job or gets the wake up
+		{ std::lock_guard<std::mutex> guard(*jobs.sleepLock); }
+		jobs.wake->notify_one();
+	}
+}
+
+// queue a job once the jobs it is after are done
+void jobRun(job_t *job) {
+	if (--job->blockers == 0)
+		jobPush(job);
+}
+
+void jobFinish(job_t *job) {
+	if (--job->unfinished > 0)
+		return;
+	for (int k = 0; k < job->dependentCount; k++)
+		jobRun(job->dependents[k]);
+	if (job->name)
+		jobStatAdd(job->name, job->busy.load(), clockNs() - job->queued);
+	job_t *parent = job->parent;
+	job->done.store(true, std::memory_order_release);
+	if (parent)
+		jobFinish(parent);
+}
+
+void jobExecute(job_t *job) {
+	PROFILE_ZONE(job->name ? job->name : job->parent ? job->parent->name : NULL);
+	long long start = clockNs();
+	job->fn();
+	(job->parent ? job->parent : job)->busy += clockNs() - start;
+	jobFinish(job);
+}
+
+// the next job for the thread of queue q: its own newest, a pinned one, or the oldest of another
+job_t *jobTake(int q) {
+	job_t *job = NULL;
+	{
+		jobQueue_t *own = &jobs.queues[q];
+		std::lock_guard<std::mutex> guard(own->lock);
+		if (!own->jobs.empty()) {
+			job = own->jobs.back();
+			own->jobs.pop_back();
+		} else if (!own->pinned.empty()) {
+			job = own->pinned.front();
+			own->pinned.pop_front();
+			return job;
+		}
+	}
+	int count = jobs.queueCount.load();
+	count = count < JOB_QUEUES ? count : JOB_QUEUES;
+	for (int k = 1; !job && k < count; k++) {
+		jobQueue_t *victim = &jobs.queues[(q + k) % count];
+		std::lock_guard<std::mutex> guard(victim->lock);
+		if (!victim->jobs.empty()) {
+			job = victim->jobs.front();
+			victim->jobs.pop_front();
+		}
+	}
+	if (job)
+		jobs.queued--;
+	return job;
+}
+
+// run jobs until job is done
+void jobWait(job_t *job) {
+	int q = jobQueue();
+	while (!job->done.load(std::memory_order_acquire)) {
+		job_t *next = jobTake(q);
+		if (next)
+			jobExecute(next);
+		else
+			std::this_thread::yield();
+	}
+}
+
+void jobWorker() {
+	int q = jobQueue();
+	for (;;) {
+		job_t *job = jobTake(q);
+		if (job) {
+			jobExecute(job);
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(*jobs.sleepLock);
+		jobs.sleeping++;
+		jobs.wake->wait(guard, [] { return jobs.queued.load() > 0; });
+		jobs.sleeping--;
+	}
+}
+
+// run fn over [0, n) in ranges of at least grain indices spread over the workers
+void jobFor(const char *name, int n, int grain, const std::function<void(int, int)> &fn) {
+	int chunks = (n + grain - 1) / (grain > 0 ? grain : 1);
+	if (chunks > (jobs.workers + 1) * 4)
+		chunks = (jobs.workers + 1) * 4;
+	if (chunks > JOB_POOL / 4)
+		chunks = JOB_POOL / 4;
+	if (chunks <= 1 || jobs.workers == 0) {
+		PROFILE_ZONE(name);
+		long long start = clockNs();
+		if (n > 0)
+			fn(0, n);
+		if (name)
+			jobStatAdd(name, clockNs() - start, clockNs() - start);
+		return;
+	}
+	job_t *parent = jobCreate(name, NULL, false);
+	parent->queued = clockNs();
+	parent->unfinished = chunks;
+	for (int c = 0; c < chunks; c++) {
+		int i0 = (int)((long long)n * c / chunks), i1 = (int)((long long)n * (c + 1) / chunks);
+		job_t *child = jobCreate(NULL, [&fn, i0, i1] { fn(i0, i1); }, false);
+		child->parent = parent;
+		jobRun(child);
+	}
+	jobWait(parent);
+}
+
+// the times of the named jobs since the last call; returns how many there are
+int jobStatsTake(jobTimes_t *times) {
+	int n = 0;
+	for (int k = 0; k < JOB_STATS; k++) {
+		const char *name = jobStats[k].name.load();
+		if (!name)
+			continue;
+		times[n].name = name;
+		times[n].busy = jobStats[k].busy.exchange(0) / 1e6;
+		times[n].wall = jobStats[k].wall.exchange(0) / 1e6;
+		times[n].count = jobStats[k].count.exchange(0);
+		n++;
+	}
+	return n;
+}
+
+// run the jobs of a graph, their edges already added, and wait for all of them
+void jobGraph(job_t **stages, int count) {
+	job_t *all = jobCreate(NULL, [] {}, true);
+	for (int k = 0; k < count; k++)
+		jobAfter(all, stages[k]);
+	for (int k = 0; k < count; k++)
+		jobRun(stages[k]);
+	jobRun(all);
+	jobWait(all);
+}
+
+// start the workers, one less than the cores unless --jobs says otherwise
+void jobInit() {
+	if (jobs.workers < 0)
+		jobs.workers = (int)std::thread::hardware_concurrency() - 1;
+	if (jobs.workers > JOB_QUEUES - 4)
+		jobs.workers = JOB_QUEUES - 4;
+	if (jobs.workers < 0)
+		jobs.workers = 0;
+	jobs.queues = new jobQueue_t[JOB_QUEUES];
+	jobs.pool = new job_t[JOB_QUEUES * JOB_POOL];
+	jobs.sleepLock = new std::mutex;
+	jobs.wake = new std::condition_variable;
+	jobQueue();
+	for (int w = 0; w < jobs.workers; w++)
+		std::thread(jobWorker).detach();
+}
+
+/************************************************************************************************
+ * Terrain
+ *
+ * The island is a square grid of terrain.size samples spanning terrain.worldSize world units.
+ * terrain.size is a multiple of MAX_TESSELLATION plus one, so every tessellation takes every
+ * global.next'th sample. Normals at the edge of the grid need neighbours outside it, so the grid
+ * is surrounded by terrain.pad border samples repeated from its edge. terrainAt() reads any
+ * sample from -pad to size - 1 + pad, terrainClamped() any sample at all, as if the border
+ * went on forever.
+ *
+ * The built in island is islandHeight. --terrain replaces it with a heightmap: 8 bit images
+ * through SOIL, 8 or 16 bit binary PGM and raw 16 bit little endian samples (.raw, .r16), the
+ * last two read straight from a memory mapped file. A map that is not square or not a multiple
+ * of MAX_TESSELLATION plus one is padded with its edge samples to the next size that is,
+ * keeping its sample spacing, so the island stays centred and to scale.
+ *
+ * With --terrain-quantise the grid is kept as 16 bit samples instead of floats, in tiles of
+ * TERRAIN_TILE x TERRAIN_TILE samples stored one after the other. Each tile has its own scale and
+ * offset over the range of its samples, so the error is at most 1/131070 of the height range of
+ * a tile. A map is quantised a band of tiles at a time as it is loaded or generated, so a 16k x 16k
+ * map never needs the 1 GB of floats, only its 512 MB of samples. terrainAt() decodes samples
+ * and clamps the border onto the edge instead of storing it.
+ *
+ * --terrain-layout picks how the grid is laid out in memory. rows is the padded row order grid.
+ * tiles stores floats in the same tiles as quantised samples, so the neighbours of a sample are
+ * a few hundred bytes away rather than a row of the map, and morton also orders the samples of
+ * a tile along a Z curve, so any 2^k x 2^k square of a tile is contiguous. The tiled layouts clamp
+ * the border like quantised samples, and quantised samples are always tiled. --bench-terrain-layout
+ * compares random queries and neighbourhood sweeps over the layouts.
+ *************************************************************************************************/
+#define ISLAND_SIZE (MAX_TESSELLATION + 1)
+#define TERRAIN_TILE_SHIFT 6
+#define TERRAIN_TILE (1 << TERRAIN_TILE_SHIFT) // samples per side of a tile
+
+enum { TERRAIN_ROWS, TERRAIN_TILES, TERRAIN_MORTON, TERRAIN_LAYOUT_NUM };
+
+static const char *terrainLayoutNames[TERRAIN_LAYOUT_NUM] = { "rows", "tiles", "morton" };
+
+// the built in island, ISLAND_SIZE x ISLAND_SIZE samples spanning RANGE
+static const GLfloat islandHeight[ISLAND_SIZE * ISLAND_SIZE] = {
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.8f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.8f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.8f, 1.0f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.8f, 1.8f, 1.8f, 2.5f, 2.5f, 2.5f, 2.5f, 2.5f, 1.8f, 1.6f, 1.6f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.8f, 1.8f, 2.5f, 2.5f, 2.5f, 4.0f, 4.0f, 4.0f, 2.5f, 2.5f, 2.5f, 1.6f, 1.6f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.8f, 2.5f, 2.5f, 4.0f, 4.0f, 4.0f, 5.0f, 4.0f, 4.0f, 4.0f, 2.5f, 2.5f, 1.6f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.8f, 2.5f, 2.5f, 4.1f, 4.3f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 4.0f, 2.5f, 1.8f, 1.6f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.8f, 2.5f, 4.0f, 4.6f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 2.5f, 2.5f, 1.6f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.8f, 2.5f, 2.5f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 2.5f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.8f, 2.5f, 4.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 4.0f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.6f, 1.8f, 2.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.6f, 1.8f, 2.0f, 4.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 4.0f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.6f, 1.8f, 2.0f, 2.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 2.5f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.6f, 1.8f, 2.0f, 4.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.5f, 4.0f, 2.5f, 1.2f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.6f, 1.8f, 2.0f, 2.0f, 3.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.6f, 4.5f, 2.5f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.6f, 1.6f, 1.8f, 2.0f, 2.0f, 3.0f, 4.0f, 4.0f, 5.0f, 4.0f, 4.0f, 4.0f, 1.5f, 1.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.6f, 0.8f, 1.0f, 1.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.8f, 2.0f, 2.0f, 2.0f, 4.0f, 4.0f, 4.0f, 1.5f, 1.5f, 1.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.6f, 0.8f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.8f, 1.8f, 2.0f, 2.0f, 2.0f, 2.0f, 1.8f, 1.6f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.6f, 0.6f, 0.8f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.6f, 1.6f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.6f, 0.6f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.6f, 1.6f, 1.6f, 1.6f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.6f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.6f, 1.6f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.6f, 0.8f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.4f, 1.4f, 1.4f, 1.4f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.6f, 0.8f, 0.8f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.4f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.2f, 1.2f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f
+};
+
+typedef struct {
+	const char *filename; // heightmap to load, NULL for the built in island
+	int size; // samples per side of the grid
+	int pad; // border samples on each side
+	int stride; // samples per row including the border
+	GLfloat *data; // the whole grid including the border
+	GLfloat *height; // the first grid sample in data
+	float worldSize; // world units the grid spans
+	float heightScale; // world height of a full range sample in a heightmap
+	int layout; // --terrain-layout
+	bool quantise; // --terrain-quantise
+	int tiles; // tiles per side
+	int tileColumn[TERRAIN_TILE], tileRow[TERRAIN_TILE]; // offsets in a tile of its columns and rows
+	GLfloat *tiled; // float grid tile by tile in the tiled layouts
+	GLushort *samples; // quantised grid tile by tile; NULL for floats
+	float *tileScale, *tileOffset; // height = sample * scale + offset
+} terrain_t;
+
+terrain_t terrain = { NULL, 0, 1, 0, NULL, NULL, RANGE, 5.0f, TERRAIN_ROWS, false };
+
+enum { SAMPLE_FLOAT, SAMPLE_U8, SAMPLE_U16_LE, SAMPLE_U16_BE };
+
+// the bits of a sample coordinate within a tile spread out to every other bit
+int mortonSpread(int v) {
+	v = (v | v << 4) & 0x0f0f;
+	v = (v | v << 2) & 0x3333;
+	return (v | v << 1) & 0x5555;
+}
+
+// index of grid sample (i, j) in a tiled grid; the tile is the index >> 2 * TERRAIN_TILE_SHIFT
+inline size_t terrainTileIndex(int i, int j) {
+	size_t tile = (size_t)(j >> TERRAIN_TILE_SHIFT) * terrain.tiles + (i >> TERRAIN_TILE_SHIFT);
+	return tile << (2 * TERRAIN_TILE_SHIFT) | terrain.tileColumn[i & (TERRAIN_TILE - 1)] | terrain.tileRow[j & (TERRAIN_TILE - 1)];
+}
+
+GLfloat terrainAt(int i, int j) {
+	if (terrain.height)
+		return terrain.height[j * terrain.stride + i];
+	i = i < 0 ? 0 : i >= terrain.size ? terrain.size - 1 : i;
+	j = j < 0 ? 0 : j >= terrain.size ? terrain.size - 1 : j;
+	size_t k = terrainTileIndex(i, j);
+	if (terrain.tiled)
+		return terrain.tiled[k];
+	size_t tile = k >> (2 * TERRAIN_TILE_SHIFT);
+	return terrain.samples[k] * terrain.tileScale[tile] + terrain.tileOffset[tile];
+}
+
+// whether the whole terrain is in memory, in any layout, rather than paged
+bool terrainResident() {
+	return terrain.height || terrain.tiled || terrain.samples;
+}
+
+// n samples of row j from sample i0 of a tiled grid, gathered into scratch
+const GLfloat *terrainGather(int j, int i0, int n, GLfloat *scratch) {
+	int size = terrain.size, i1 = i0 + n;
+	if (j < 0 || j >= size || i0 < 0 || i1 > size) {
+		for (int i = 0; i < n; i++)
+			scratch[i] = terrainAt(i0 + i, j);
+		return scratch;
+	}
+	// a tile at a time, finding the row in the tile once
+	for (int i = i0; i < i1; ) {
+		int end = ((i >> TERRAIN_TILE_SHIFT) + 1) << TERRAIN_TILE_SHIFT;
+		end = end < i1 ? end : i1;
+		size_t tile = (size_t)(j >> TERRAIN_TILE_SHIFT) * terrain.tiles + (i >> TERRAIN_TILE_SHIFT);
+		size_t row = tile << (2 * TERRAIN_TILE_SHIFT) | terrain.tileRow[j & (TERRAIN_TILE - 1)];
+		GLfloat *out = scratch + (i - i0);
+		if (terrain.tiled) {
+			for (; i < end; i++)
+				*out++ = terrain.tiled[row | terrain.tileColumn[i & (TERRAIN_TILE - 1)]];
+		} else {
+			float scale = terrain.tileScale[tile], offset = terrain.tileOffset[tile];
+			for (; i < end; i++)
+				*out++ = terrain.samples[row | terrain.tileColumn[i & (TERRAIN_TILE - 1)]] * scale + offset;
+		}
+	}
+	return scratch;
+}
+
+// n samples of row j from sample i0, pointing into the grid or gathered into scratch
+inline const GLfloat *terrainSamples(int j, int i0, int n, GLfloat *scratch) {
+	if (terrain.height)
+		return terrain.height + (size_t)j * terrain.stride + i0;
+	// the samples of a row of a tile follow each other in the tiles layout
+	if (terrain.layout == TERRAIN_TILES && terrain.tiled && j >= 0 && j < terrain.size && i0 >= 0 && i0 + n <= terrain.size
+		&& i0 >> TERRAIN_TILE_SHIFT == (i0 + n - 1) >> TERRAIN_TILE_SHIFT)
+		return terrain.tiled + terrainTileIndex(i0, j);
+	return terrainGather(j, i0, n, scratch);
+}
+
+GLfloat terrainClamped(int i, int j) {
+	int lo = -terrain.pad, hi = terrain.size - 1 + terrain.pad;
+	i = i < lo ? lo : i > hi ? hi : i;
+	j = j < lo ? lo : j > hi ? hi : j;
+	return terrainAt(i, j);
+}
+
+// convert row j of a w samples wide map to heights
+void terrainRow(const unsigned char *src, int format, int w, int j, float scale, GLfloat *dst) {
+	switch (format) {
+	case SAMPLE_FLOAT:
+		memcpy(dst, (const GLfloat *)src + (size_t)j * w, w * sizeof(GLfloat));
+		break;
+	case SAMPLE_U8:
+		src += (size_t)j * w;
+		for (int i = 0; i < w; i++)
+			dst[i] = src[i] * scale;
+		break;
+	case SAMPLE_U16_LE:
+		src += (size_t)j * w * 2;
+		for (int i = 0; i < w; i++)
+			dst[i] = (src[i * 2] | src[i * 2 + 1] << 8) * scale;
+		break;
+	case SAMPLE_U16_BE:
+		src += (size_t)j * w * 2;
+		for (int i = 0; i < w; i++)
+			dst[i] = (src[i * 2] << 8 | src[i * 2 + 1]) * scale;
+		break;
+	}
+}
+
+// smallest terrain size that holds n samples per side
+int terrainSizeFor(int n) {
+	return (n - 1 + MAX_TESSELLATION - 1) / MAX_TESSELLATION * MAX_TESSELLATION + 1;
+}
+
+// replace the grid with an unfilled one of size x size samples, plus the border unless tiled
+bool terrainAlloc(int size) {
+	// quantised samples are only kept in tiles
+	if (terrain.quantise && terrain.layout == TERRAIN_ROWS)
+		terrain.layout = TERRAIN_TILES;
+	int stride = size + 2 * terrain.pad, tiles = (size + TERRAIN_TILE - 1) / TERRAIN_TILE;
+	size_t count = (size_t)tiles * tiles * TERRAIN_TILE * TERRAIN_TILE;
+	GLfloat *data = NULL, *tiled = NULL, *tileScale = NULL, *tileOffset = NULL;
+	GLushort *samples = NULL;
+	bool ok;
+	if (terrain.quantise) {
+		samples = (GLushort *)malloc(count * sizeof(GLushort));
+		tileScale = (float *)malloc((size_t)tiles * tiles * sizeof(float));
+		tileOffset = (float *)malloc((size_t)tiles * tiles * sizeof(float));
+		ok = samples && tileScale && tileOffset;
+	} else if (terrain.layout != TERRAIN_ROWS) {
+		ok = (tiled = (GLfloat *)malloc(count * sizeof(GLfloat))) != NULL;
+	} else {
+		ok = (data = (GLfloat *)malloc((size_t)stride * stride * sizeof(GLfloat))) != NULL;
+	}
+	if (!ok) {
+		printf("Not enough memory for a %d x %d terrain.\n", size, size);
+		free(samples);
+		free(tileScale);
+		free(tileOffset);
+		return false;
+	}
+	free(terrain.data);
+	free(terrain.tiled);
+	free(terrain.samples);
+	free(terrain.tileScale);
+	free(terrain.tileOffset);
+	terrain.size = size;
+	terrain.stride = stride;
+	terrain.data = data;
+	terrain.height = data ? data + terrain.pad * stride + terrain.pad : NULL;
+	terrain.tiles = tiles;
+	for (int a = 0; a < TERRAIN_TILE; a++) {
+		terrain.tileColumn[a] = terrain.layout == TERRAIN_MORTON ? mortonSpread(a) : a;
+		terrain.tileRow[a] = terrain.layout == TERRAIN_MORTON ? mortonSpread(a) << 1 : a << TERRAIN_TILE_SHIFT;
+	}
+	terrain.tiled = tiled;
+	terrain.samples = samples;
+	terrain.tileScale = tileScale;
+	terrain.tileOffset = tileOffset;
+	return true;
+}
+
+// store count rows from row j0, the start of a band of tiles, given stride floats apart, in a tiled grid
+void terrainStoreBand(int j0, const GLfloat *rows, int count, int stride) {
+	int tz = j0 >> TERRAIN_TILE_SHIFT;
+	for (int tx = 0; tx < terrain.tiles; tx++) {
+		int i0 = tx * TERRAIN_TILE, n = terrain.size - i0 < TERRAIN_TILE ? terrain.size - i0 : TERRAIN_TILE;
+		if (terrain.tiled) {
+			for (int j = 0; j < count; j++)
+				for (int i = 0; i < n; i++)
+					terrain.tiled[terrainTileIndex(i0 + i, j0 + j)] = rows[(size_t)j * stride + i0 + i];
+			continue;
+		}
+		float lo = 1e30f, hi = -1e30f;
+		for (int j = 0; j < count; j++) {
+			for (int i = 0; i < n; i++) {
+				float y = rows[(size_t)j * stride + i0 + i];
+				lo = y < lo ? y : lo;
+				hi = y > hi ? y : hi;
+			}
+		}
+		int tile = tz * terrain.tiles + tx;
+		float scale = (hi - lo) / 65535.0f, inverse = hi > lo ? 65535.0f / (hi - lo) : 0.0f;
+		terrain.tileScale[tile] = scale;
+		terrain.tileOffset[tile] = lo;
+		for (int j = 0; j < count; j++)
+			for (int i = 0; i < n; i++)
+				terrain.samples[terrainTileIndex(i0 + i, j0 + j)] = (GLushort)lrintf((rows[(size_t)j * stride + i0 + i] - lo) * inverse);
+	}
+}
+
+// build the padded grid from a w x h map that spans terrain.worldSize along its longer side
+bool terrainBuild(const unsigned char *src, int format, int w, int h, float scale) {
+	int n = w > h ? w : h;
+	if (w < 2 || h < 2) {
+		printf("A %d x %d heightmap is too small.\n", w, h);
+		return false;
+	}
+	int size = terrainSizeFor(n);
+	if (!terrainAlloc(size))
+		return false;
+	int pad = terrain.pad, stride = terrain.stride;
+	// a tiled grid is built in bands of TERRAIN_TILE padded rows
+	GLfloat *band = NULL;
+	if (!terrain.height && !(band = (GLfloat *)malloc((size_t)TERRAIN_TILE * stride * sizeof(GLfloat)))) {
+		printf("Not enough memory for a %d x %d terrain.\n", size, size);
+		return false;
+	}
+	// grid position of the first map sample
+	int x0 = pad + (size - w) / 2, z0 = pad + (size - h) / 2;
+	int last = -1;
+	GLfloat *prev = NULL;
+	for (int j = 0; j < stride; j++) {
+		int g = j - pad; // grid row
+		GLfloat *row = !band ? terrain.data + (size_t)j * stride : band + (g >= 0 && g < size ? g % TERRAIN_TILE : 0) * stride;
+		int k = j < z0 ? 0 : j >= z0 + h ? h - 1 : j - z0;
+		if (k == last) {
+			if (row != prev)
+				memcpy(row, prev, stride * sizeof(GLfloat));
+		} else {
+			terrainRow(src, format, w, k, scale, row + x0);
+			for (int i = 0; i < x0; i++)
+				row[i] = row[x0];
+			for (int i = x0 + w; i < stride; i++)
+				row[i] = row[x0 + w - 1];
+			last = k;
+		}
+		prev = row;
+		if (band && g >= 0 && g < size && (g % TERRAIN_TILE == TERRAIN_TILE - 1 || g == size - 1))
+			terrainStoreBand(g - g % TERRAIN_TILE, band + pad, g % TERRAIN_TILE + 1, stride);
+	}
+	free(band);
+	terrain.worldSize *= float(size - 1) / (n - 1);
+	return true;
+}
+
+// map a whole file read only; returns NULL on failure
+const unsigned char *mapFile(const char *filename, size_t *bytes) {
+	void *p = NULL;
+#if _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping) {
+		p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		*bytes = (size_t)fileSize.QuadPart;
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
+			p = NULL;
+		*bytes = st.st_size;
+	}
+	close(fd);
+#endif
+	return (const unsigned char *)p;
+}
+
+void unmapFile(const unsigned char *p, size_t bytes) {
+#if _WIN32
+	UnmapViewOfFile(p);
+#else
+	munmap((void *)p, bytes);
+#endif
+}
+
+// read the next number of a PGM header, skipping white space and comments
+int pgmNumber(const unsigned char *p, size_t bytes, size_t *at) {
+	while (*at < bytes && (isspace(p[*at]) || p[*at] == '#')) {
+		if (p[*at] == '#')
+			while (*at < bytes && p[*at] != '\n')
+				(*at)++;
+		else
+			(*at)++;
+	}
+	int value = 0;
+	while (*at < bytes && isdigit(p[*at]))
+		value = value * 10 + p[(*at)++] - '0';
+	return value;
+}
+
+// load a raw 16 bit or PGM heightmap through a memory mapping
+bool terrainLoadMapped(const char *filename, bool raw) {
+	size_t bytes = 0;
+	const unsigned char *p = mapFile(filename, &bytes);
+	if (!p) {
+		printf("Failed to map heightmap %s.\n", filename);
+		return false;
+	}
+	bool ok = false;
+	if (raw) {
+		// raw maps are square, so the side follows from the file size
+		int n = (int)(sqrt(bytes / 2.0) + 0.5);
+		if ((size_t)n * n * 2 != bytes)
+			printf("%s is not a square map of 16 bit samples.\n", filename);
+		else
+			ok = terrainBuild(p, SAMPLE_U16_LE, n, n, terrain.heightScale / 65535.0f);
+	} else {
+		size_t at = 2;
+		int w = 0, h = 0, maxValue = 0;
+		if (bytes > 2 && p[0] == 'P' && p[1] == '5') {
+			w = pgmNumber(p, bytes, &at);
+			h = pgmNumber(p, bytes, &at);
+			maxValue = pgmNumber(p, bytes, &at);
+			at++; // the single white space before the samples
+		}
+		int sampleBytes = maxValue > 255 ? 2 : 1;
+		if (w <= 0 || h <= 0 || maxValue <= 0 || maxValue > 65535 || at + (size_t)w * h * sampleBytes > bytes)
+			printf("%s is not a binary PGM heightmap.\n", filename);
+		else
+			ok = terrainBuild(p + at, sampleBytes == 2 ? SAMPLE_U16_BE : SAMPLE_U8, w, h, terrain.heightScale / maxValue);
+	}
+	unmapFile(p, bytes);
+	return ok;
+}
+
+/************************************************************************************************
+ * Terrain normals
+ *
+ * terrainNormals() computes the central difference normal of every terrain sample once, when a
+ * level of detail terrain is set up, packed as RGB bytes for a normal map. Each row is one pass of
+ * terrainNormalRow(), which works on four samples at a time with SSE where it is available. Maps
+ * of more than TERRAIN_NORMAL_BAND rows are split into bands of rows generated by one thread each.
+ *************************************************************************************************/
+#define TERRAIN_NORMAL_BAND 256
+
+// normals of n samples of row, whose neighbours are down (j - 1) and up (j + 1); ny is twice the sample spacing
+void terrainNormalRow(const GLfloat *down, const GLfloat *row, const GLfloat *up, int n, float ny, GLubyte *out) {
+	int i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+	const __m128 y = _mm_set1_ps(ny), half = _mm_set1_ps(127.5f), three = _mm_set1_ps(3.0f);
+	for (; i + 4 <= n; i += 4, out += 12) {
+		__m128 x = _mm_sub_ps(_mm_loadu_ps(row + i - 1), _mm_loadu_ps(row + i + 1));
+		__m128 z = _mm_sub_ps(_mm_loadu_ps(down + i), _mm_loadu_ps(up + i));
+		__m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+		// reciprocal square root estimate refined by one Newton step
+		__m128 r = _mm_rsqrt_ps(length2);
+		r = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r), _mm_sub_ps(three, _mm_mul_ps(length2, _mm_mul_ps(r, r))));
+		r = _mm_mul_ps(r, half);
+		int c[3][4];
+		_mm_storeu_si128((__m128i *)c[0], _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(x, r), half)));
+		_mm_storeu_si128((__m128i *)c[1], _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(y, r), half)));
+		_mm_storeu_si128((__m128i *)c[2], _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(z, r), half)));
+		for (int k = 0; k < 4; k++) {
+			out[k * 3] = (GLubyte)c[0][k];
+			out[k * 3 + 1] = (GLubyte)c[1][k];
+			out[k * 3 + 2] = (GLubyte)c[2][k];
+		}
+	}
+#endif
+	for (; i < n; i++, out += 3) {
+		float x = row[i - 1] - row[i + 1], z = down[i] - up[i];
+		float r = 127.5f / sqrtf(x * x + ny * ny + z * z);
+		out[0] = (GLubyte)lrintf(x * r + 127.5f);
+		out[1] = (GLubyte)lrintf(ny * r + 127.5f);
+		out[2] = (GLubyte)lrintf(z * r + 127.5f);
+	}
+}
+
+// normals of rows j0 to j1 - 1 into a size x size RGB image
+void terrainNormalBand(int j0, int j1, GLubyte *normals) {
+	float ny = 2.0f * terrain.worldSize / (terrain.size - 1);
+	// rows of a tiled grid are gathered with their border samples into scratch
+	std::vector<GLfloat> scratch(terrain.height ? 0 : 3 * (size_t)(terrain.size + 2));
+	GLfloat *rows[3] = { scratch.data(), scratch.data() + terrain.size + 2, scratch.data() + 2 * (terrain.size + 2) };
+	for (int j = j0; j < j1; j++) {
+		const GLfloat *down = terrainSamples(j - 1, -1, terrain.size + 2, rows[0]) + 1;
+		const GLfloat *row = terrainSamples(j, -1, terrain.size + 2, rows[1]) + 1;
+		const GLfloat *up = terrainSamples(j + 1, -1, terrain.size + 2, rows[2]) + 1;
+		terrainNormalRow(down, row, up, terrain.size, ny, normals + (size_t)j * terrain.size * 3);
+	}
+}
+
+// normals of the whole terrain into a size x size RGB image, spread over the available cores
+void terrainNormals(GLubyte *normals) {
+	jobFor("terrain normals", terrain.size, TERRAIN_NORMAL_BAND, [normals](int j0, int j1) {
+		terrainNormalBand(j0, j1, normals);
+	});
+}
+
+/************************************************************************************************
+ * Terrain noise
+ *
+ * --terrain-noise N generates an island of N x N samples, rounded up like a heightmap, instead
+ * of loading one. Its heights are fractal gradient noise, fBm or ridged (--terrain-noise-type),
+ * on a hill that falls to the sea at the circle inside the map, like the built in island. The gradients come
+ * from a hash of the lattice corner and --terrain-seed rather than a permutation table, so a seed
+ * gives the same island on every machine and there is nothing to set up.
+ *
+ * terrainNoiseRow() fills a row four samples at a time with SSE2 where it is available, doing the
+ * same float operations as the scalar terrainNoiseAt(), and the rows are split into bands over
+ * all cores like the normals.
+ *************************************************************************************************/
+enum { NOISE_FBM, NOISE_RIDGED, NOISE_TYPE_NUM };
+
+static const char *noiseTypeNames[NOISE_TYPE_NUM] = { "fbm", "ridged" };
+
+typedef struct {
+	int size; // --terrain-noise, 0 to load the terrain instead
+	int type;
+	unsigned seed;
+	int octaves;
+	float frequency; // noise cycles across the map in the first octave
+	float gain; // amplitude of each octave relative to the one before
+} terrainNoise_t;
+
+terrainNoise_t terrainNoise = { 0, NOISE_FBM, 1, 6, 3.0f, 0.5f };
+
+unsigned noiseHash(unsigned x, unsigned z, unsigned seed) {
+	unsigned h = (x * 0x27d4eb2du) ^ (z * 0x165667b1u) ^ seed;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	return h ^ h >> 12;
+}
+
+// one of the four diagonal gradients, picked by the low bits of h, dotted with (x, z)
+float noiseGrad(unsigned h, float x, float z) {
+	return (h & 1 ? -x : x) + (h & 2 ? -z : z);
+}
+
+float noiseFade(float t) {
+	return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f);
+}
+
+// gradient noise at (x, z), within [-1, 1]
+float noiseGradient(float x, float z, unsigned seed) {
+	float x0 = floorf(x), z0 = floorf(z);
+	unsigned i = (unsigned)(int)x0, j = (unsigned)(int)z0;
+	x -= x0;
+	z -= z0;
+	float u = noiseFade(x), v = noiseFade(z);
+	float n00 = noiseGrad(noiseHash(i, j, seed), x, z);
+	float n10 = noiseGrad(noiseHash(i + 1, j, seed), x - 1.0f, z);
+	float n01 = noiseGrad(noiseHash(i, j + 1, seed), x, z - 1.0f);
+	float n11 = noiseGrad(noiseHash(i + 1, j + 1, seed), x - 1.0f, z - 1.0f);
+	float a = n00 + (n10 - n00) * u, b = n01 + (n11 - n01) * u;
+	return a + (b - a) * v;
+}
+
+// sum of all octave amplitudes, to bring the fractal sum back to [-1, 1]
+float noiseAmplitude() {
+	float sum = 0.0f, amplitude = 1.0f;
+	for (int o = 0; o < terrainNoise.octaves; o++, amplitude *= terrainNoise.gain)
+		sum += amplitude;
+	return sum;
+}
+
+// height of sample (i, j)
+float terrainNoiseAt(int i, int j) {
+	float step = terrainNoise.frequency / (terrain.size - 1);
+	float x = i * step, z = j * step, sum = 0.0f, amplitude = 1.0f;
+	for (int o = 0; o < terrainNoise.octaves; o++) {
+		float n = noiseGradient(x, z, terrainNoise.seed + o);
+		if (terrainNoise.type == NOISE_RIDGED) {
+			n = 1.0f - fabsf(n);
+			n = n * n;
+		}
+		sum += n * amplitude;
+		amplitude *= terrainNoise.gain;
+		x *= 2.0f;
+		z *= 2.0f;
+	}
+	sum /= noiseAmplitude();
+	float base = terrainNoise.type == NOISE_RIDGED ? sum : sum * 0.5f + 0.5f;
+	// a hill of heightScale on average, falling from 0.2 of the way to the edge down to 0 at it
+	float dx = i * 2.0f / (terrain.size - 1) - 1.0f, dz = j * 2.0f / (terrain.size - 1) - 1.0f;
+	float t = (sqrtf(dx * dx + dz * dz) - 0.2f) / 0.8f;
+	t = fminf(fmaxf(t, 0.0f), 1.0f);
+	return terrain.heightScale * (base + 0.5f) * (1.0f - t * t * (3.0f - 2.0f * t));
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// low 32 bits of a * b in each lane, which SSE2 has no single instruction for
+static inline __m128i noiseMul(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128 noiseGrad4(__m128i i, __m128i j, __m128i seed, __m128 x, __m128 z) {
+	__m128i h = _mm_xor_si128(_mm_xor_si128(noiseMul(i, _mm_set1_epi32(0x27d4eb2d)), noiseMul(j, _mm_set1_epi32(0x165667b1))), seed);
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+	h = noiseMul(h, _mm_set1_epi32(0x2c1b3c6d));
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 12));
+	// the low two bits of h flip the signs of x and z
+	__m128 sx = _mm_castsi128_ps(_mm_slli_epi32(h, 31)), sz = _mm_castsi128_ps(_mm_slli_epi32(_mm_srli_epi32(h, 1), 31));
+	return _mm_add_ps(_mm_xor_ps(x, sx), _mm_xor_ps(z, sz));
+}
+
+static inline __m128 noiseFade4(__m128 t) {
+	__m128 inner = _mm_add_ps(_mm_mul_ps(t, _mm_sub_ps(_mm_mul_ps(t, _mm_set1_ps(6.0f)), _mm_set1_ps(15.0f))), _mm_set1_ps(10.0f));
+	return _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), inner);
+}
+
+static inline __m128 noiseGradient4(__m128 x, __m128 z, __m128i seed) {
+	// floor, as truncation moved down for negative coordinates
+	__m128i i = _mm_cvttps_epi32(x), j = _mm_cvttps_epi32(z);
+	i = _mm_add_epi32(i, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(i), x)));
+	j = _mm_add_epi32(j, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(j), z)));
+	x = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+	z = _mm_sub_ps(z, _mm_cvtepi32_ps(j));
+	__m128 u = noiseFade4(x), v = noiseFade4(z), one = _mm_set1_ps(1.0f);
+	__m128i i1 = _mm_add_epi32(i, _mm_set1_epi32(1)), j1 = _mm_add_epi32(j, _mm_set1_epi32(1));
+	__m128 x1 = _mm_sub_ps(x, one), z1 = _mm_sub_ps(z, one);
+	__m128 n00 = noiseGrad4(i, j, seed, x, z), n10 = noiseGrad4(i1, j, seed, x1, z);
+	__m128 n01 = noiseGrad4(i, j1, seed, x, z1), n11 = noiseGrad4(i1, j1, seed, x1, z1);
+	__m128 a = _mm_add_ps(n00, _mm_mul_ps(_mm_sub_ps(n10, n00), u));
+	__m128 b = _mm_add_ps(n01, _mm_mul_ps(_mm_sub_ps(n11, n01), u));
+	return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), v));
+}
+#endif
+
+// heights of row j, with SSE2 unless simd is false
+void terrainNoiseRow(int j, GLfloat *row, bool simd) {
+	int i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+	float step = terrainNoise.frequency / (terrain.size - 1), amplitudes = noiseAmplitude();
+	float dz = j * 2.0f / (terrain.size - 1) - 1.0f, edge = terrain.size - 1;
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)), one = _mm_set1_ps(1.0f);
+	for (; simd && i + 4 <= terrain.size; i += 4) {
+		__m128 fi = _mm_cvtepi32_ps(_mm_setr_epi32(i, i + 1, i + 2, i + 3));
+		__m128 x = _mm_mul_ps(fi, _mm_set1_ps(step)), z = _mm_set1_ps(j * step), sum = _mm_setzero_ps();
+		float amplitude = 1.0f;
+		for (int o = 0; o < terrainNoise.octaves; o++) {
+			__m128 n = noiseGradient4(x, z, _mm_set1_epi32(terrainNoise.seed + o));
+			if (terrainNoise.type == NOISE_RIDGED) {
+				n = _mm_sub_ps(one, _mm_and_ps(n, absMask));
+				n = _mm_mul_ps(n, n);
+			}
+			sum = _mm_add_ps(sum, _mm_mul_ps(n, _mm_set1_ps(amplitude)));
+			amplitude *= terrainNoise.gain;
+			x = _mm_mul_ps(x, _mm_set1_ps(2.0f));
+			z = _mm_mul_ps(z, _mm_set1_ps(2.0f));
+		}
+		sum = _mm_div_ps(sum, _mm_set1_ps(amplitudes));
+		__m128 base = terrainNoise.type == NOISE_RIDGED ? sum : _mm_add_ps(_mm_mul_ps(sum, _mm_set1_ps(0.5f)), _mm_set1_ps(0.5f));
+		__m128 dx = _mm_sub_ps(_mm_div_ps(_mm_mul_ps(fi, _mm_set1_ps(2.0f)), _mm_set1_ps(edge)), one);
+		__m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_set1_ps(dz * dz)));
+		__m128 t = _mm_div_ps(_mm_sub_ps(d, _mm_set1_ps(0.2f)), _mm_set1_ps(0.8f));
+		t = _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), one);
+		__m128 fade = _mm_sub_ps(one, _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_set1_ps(2.0f), t))));
+		_mm_storeu_ps(row + i, _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(terrain.heightScale), _mm_add_ps(base, _mm_set1_ps(0.5f))), fade));
+	}
+#endif
+	for (; i < terrain.size; i++)
+		row[i] = terrainNoiseAt(i, j);
+}
+
+// rows j0 to j1 - 1, where j0 starts a band of tiles
+void terrainNoiseBand(int j0, int j1, bool simd) {
+	std::vector<GLfloat> band(terrain.height ? 0 : (size_t)TERRAIN_TILE * terrain.size);
+	for (int j = j0; j < j1; j++) {
+		if (terrain.height) {
+			terrainNoiseRow(j, terrain.height + (size_t)j * terrain.stride, simd);
+			continue;
+		}
+		terrainNoiseRow(j, &band[(size_t)(j % TERRAIN_TILE) * terrain.size], simd);
+		if (j % TERRAIN_TILE == TERRAIN_TILE - 1 || j == terrain.size - 1)
+			terrainStoreBand(j - j % TERRAIN_TILE, band.data(), j % TERRAIN_TILE + 1, terrain.size);
+	}
+}
+
+// fill the border around the grid with copies of its edge samples
+void terrainPadBorder() {
+	int pad = terrain.pad, last = terrain.size - 1;
+	for (int j = 0; j <= last; j++) {
+		GLfloat *row = terrain.height + (size_t)j * terrain.stride;
+		for (int p = 1; p <= pad; p++) {
+			row[-p] = row[0];
+			row[last + p] = row[last];
+		}
+	}
+	for (int p = 1; p <= pad; p++) {
+		memcpy(terrain.height - (size_t)p * terrain.stride - pad, terrain.height - pad, terrain.stride * sizeof(GLfloat));
+		memcpy(terrain.height + (size_t)(last + p) * terrain.stride - pad, terrain.height + (size_t)last * terrain.stride - pad, terrain.stride * sizeof(GLfloat));
+	}
+}
+
+// generate the island of --terrain-noise over the available cores
+bool terrainNoiseBuild(bool simd) {
+	if (terrainNoise.size < 2 || terrainNoise.octaves < 1) {
+		printf("A noise island needs at least 2 x 2 samples and one octave.\n");
+		return false;
+	}
+	if (!terrainAlloc(terrainSizeFor(terrainNoise.size)))
+		return false;
+	// jobs take whole bands of tiles
+	jobFor("terrain noise", terrain.tiles, 1, [simd](int t0, int t1) {
+		int j1 = t1 * TERRAIN_TILE;
+		terrainNoiseBand(t0 * TERRAIN_TILE, j1 < terrain.size ? j1 : terrain.size, simd);
+	});
+	if (terrain.height)
+		terrainPadBorder();
+	return true;
+}
 
 /************************************************************************************************
- * The height map is designed to have MAX_TESSELLATION / MIN_TESSELLATION lines of extra data
- * for the calculation of normal vectors. 
+ * Terrain paging
  *
- * For example, the height of left neighbour hL = height[n - global.next]
- * is height[- MAX_TESSELLATION / global.tessellation] for n = 0
- * if no extra data is defined.
- * In another word, for a vector x = 0, z = 0, it doesn't have a left neighbour.
- * Hence, I added height[-1] as its left neighbour and changed the array indentifier for height[-1] to positive.
- * I also added right neighbour for the right most vectors, up neighbour for the uppest vector, down neighbour for the most down vector
+ * Worlds too large to keep in memory are baked by --bake-terrain-pages into a page file and
+ * opened with --terrain-pages. The file holds the level of detail quadtree described further
+ * down: a header, the error and height bounds of every node, then one page per node with the
+ * TERRAIN_PAGE x TERRAIN_PAGE heights and normals its patch is built from.
  *
- * So when assigning height to terrian, these extra data must be excaped.
- * There are MAX_TESSELLATION / MIN_TESSELLATION lines from the top need to be excaped,
- * which is implemented using (n + MAX_TESSELLATION / MIN_TESSELLATION) * LENGTH_HEIGHT
- * There are MAX_TESSELLATION / MIN_TESSELLATION number of elements from the left need to be excaped,
- * which is implemented using m + MAX_TESSELLATION / MIN_TESSELLATION
+ * Only the pages the view asks for are read, by a loader thread, into a pool of
+ * terrainPager.budget megabytes. When the pool is full the least recently used page is dropped.
+ * The top TERRAIN_PAGER_PINNED levels are read before the game starts and never dropped, so the
+ * whole world can always be drawn and calcHeight() always has a page to answer from.
  *************************************************************************************************/
-static GLfloat height[LENGTH_HEIGHT * LENGTH_HEIGHT] = {
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.8f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.8f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.8f, 1.0f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.8f, 1.8f, 1.8f, 2.5f, 2.5f, 2.5f, 2.5f, 2.5f, 1.8f, 1.6f, 1.6f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.8f, 1.8f, 2.5f, 2.5f, 2.5f, 4.0f, 4.0f, 4.0f, 2.5f, 2.5f, 2.5f, 1.6f, 1.6f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.8f, 2.5f, 2.5f, 4.0f, 4.0f, 4.0f, 5.0f, 4.0f, 4.0f, 4.0f, 2.5f, 2.5f, 1.6f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.8f, 2.5f, 2.5f, 4.1f, 4.3f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 4.0f, 2.5f, 1.8f, 1.6f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.8f, 2.5f, 4.0f, 4.6f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 2.5f, 2.5f, 1.6f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.8f, 2.5f, 2.5f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 2.5f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.8f, 2.5f, 4.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 4.0f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.6f, 1.8f, 2.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.6f, 1.8f, 2.0f, 4.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 4.0f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.6f, 1.8f, 2.0f, 2.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.0f, 2.5f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.6f, 1.8f, 2.0f, 4.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.5f, 4.0f, 2.5f, 1.2f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.6f, 1.8f, 2.0f, 2.0f, 3.0f, 4.0f, 5.0f, 5.0f, 5.0f, 5.0f, 5.0f, 4.6f, 4.5f, 2.5f, 2.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.6f, 1.6f, 1.8f, 2.0f, 2.0f, 3.0f, 4.0f, 4.0f, 5.0f, 4.0f, 4.0f, 4.0f, 1.5f, 1.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.8f, 1.0f, 1.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.8f, 2.0f, 2.0f, 2.0f, 4.0f, 4.0f, 4.0f, 1.5f, 1.5f, 1.5f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.8f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.8f, 1.8f, 2.0f, 2.0f, 2.0f, 2.0f, 1.8f, 1.6f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.6f, 0.8f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.8f, 1.8f, 1.8f, 1.8f, 1.8f, 1.6f, 1.6f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.6f, 1.6f, 1.6f, 1.6f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.6f, 1.6f, 1.6f, 1.6f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.8f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.4f, 1.4f, 1.4f, 1.4f, 1.4f, 1.4f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.8f, 0.8f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.2f, 1.4f, 1.4f, 1.4f, 1.4f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.2f, 1.2f, 1.2f, 1.2f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 1.0f, 1.0f, 1.0f, 1.0f, 1.2f, 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-	0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.6f, 0.8f, 0.8f, 0.8f, 0.8f, 0.6f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f
-};
+#define TERRAIN_PATCH 32 // quads per side of a patch
+#define TERRAIN_PAGE (TERRAIN_PATCH + 1) // samples per side of a page
+#define TERRAIN_PAGER_PINNED 3 // quadtree levels always resident
+
+typedef struct {
+	GLfloat height[TERRAIN_PAGE * TERRAIN_PAGE];
+	GLbyte normal[TERRAIN_PAGE * TERRAIN_PAGE * 3];
+} terrainPage_t;
+
+typedef struct {
+	char magic[4]; // "IDTP"
+	int size; // terrain samples per side
+	int depth; // quadtree depth
+	float worldSize;
+} terrainPageHeader_t;
+
+enum { PAGE_FREE, PAGE_LOADING, PAGE_READY };
+
+typedef struct {
+	const char *filename; // --terrain-pages
+	const char *bakeFilename; // --bake-terrain-pages
+	int budget; // megabytes of pages
+	FILE *file;
+	int depth, nodes;
+	float *error, *minY, *maxY; // per node, handed to the level of detail tree
+	int slots;
+	terrainPage_t *pages;
+	int *slotNode; // -1 when free
+	int *slotUsed; // frame the page was last asked for
+	std::atomic<int> *slotState;
+	int *nodeSlot; // -1 when not resident
+	int frame;
+	int loads; // pages read
+	std::mutex *lock; // guards queue
+	std::condition_variable *wake;
+	std::deque<int> *queue; // slots for the loader to fill
+} terrainPager_t;
+
+terrainPager_t terrainPager = { NULL, NULL, 64 };
+
+// nodes are stored level by level, each level in row order
+int terrainLodNode(int level, int x, int z) {
+	return ((1 << 2 * level) - 1) / 3 + (z << level) + x;
+}
+
+bool terrainPageRead(int node, terrainPage_t *page) {
+	long long offset = sizeof(terrainPageHeader_t) + 3LL * terrainPager.nodes * sizeof(float) + (long long)node * sizeof(terrainPage_t);
+#if _WIN32
+	int failed = _fseeki64(terrainPager.file, offset, SEEK_SET);
+#else
+	int failed = fseeko(terrainPager.file, (off_t)offset, SEEK_SET);
+#endif
+	return !failed && fread(page, sizeof(terrainPage_t), 1, terrainPager.file) == 1;
+}
+
+// the loader thread: read the pages of queued slots, in the order they were asked for
+void terrainPagerLoader() {
+	for (;;) {
+		int slot, node;
+		{
+			std::unique_lock<std::mutex> guard(*terrainPager.lock);
+			while (terrainPager.queue->empty())
+				terrainPager.wake->wait(guard);
+			slot = terrainPager.queue->front();
+			terrainPager.queue->pop_front();
+			node = terrainPager.slotNode[slot];
+		}
+		if (!terrainPageRead(node, &terrainPager.pages[slot]))
+			printf("Failed to read terrain page %d.\n", node);
+		terrainPager.slotState[slot].store(PAGE_READY, std::memory_order_release);
+	}
+}
+
+// close the page file and free the tables of a terrainPagerOpen() that failed; returns false
+bool terrainPagerFail() {
+	if (terrainPager.file)
+		fclose(terrainPager.file);
+	free(terrainPager.error);
+	free(terrainPager.minY);
+	free(terrainPager.maxY);
+	free(terrainPager.nodeSlot);
+	free(terrainPager.pages);
+	free(terrainPager.slotNode);
+	free(terrainPager.slotUsed);
+	delete[] terrainPager.slotState;
+	terrainPager.file = NULL;
+	terrainPager.error = terrainPager.minY = terrainPager.maxY = NULL;
+	terrainPager.nodeSlot = terrainPager.slotNode = terrainPager.slotUsed = NULL;
+	terrainPager.pages = NULL;
+	terrainPager.slotState = NULL;
+	return false;
+}
+
+// open the page file, read the node tables and the pinned pages, and start the loader
+bool terrainPagerOpen() {
+	terrainPager.file = fopen(terrainPager.filename, "rb");
+	if (!terrainPager.file) {
+		printf("Failed to open terrain pages %s.\n", terrainPager.filename);
+		return false;
+	}
+	terrainPageHeader_t header;
+	if (fread(&header, sizeof header, 1, terrainPager.file) != 1 || memcmp(header.magic, "IDTP", 4)
+		|| header.depth < 0 || header.depth > 12 || header.size < 2) {
+		printf("%s is not a terrain page file.\n", terrainPager.filename);
+		return terrainPagerFail();
+	}
+	terrainPager.depth = header.depth;
+	terrainPager.nodes = terrainLodNode(header.depth + 1, 0, 0);
+	int pinned = terrainLodNode(header.depth + 1 < TERRAIN_PAGER_PINNED ? header.depth + 1 : TERRAIN_PAGER_PINNED, 0, 0);
+	terrainPager.slots = (int)((long long)terrainPager.budget * 1024 * 1024 / sizeof(terrainPage_t));
+	if (terrainPager.slots < pinned + 64)
+		terrainPager.slots = pinned + 64;
+	terrainPager.error = (float *)malloc(terrainPager.nodes * sizeof(float));
+	terrainPager.minY = (float *)malloc(terrainPager.nodes * sizeof(float));
+	terrainPager.maxY = (float *)malloc(terrainPager.nodes * sizeof(float));
+	terrainPager.nodeSlot = (int *)malloc(terrainPager.nodes * sizeof(int));
+	terrainPager.pages = (terrainPage_t *)malloc(terrainPager.slots * sizeof(terrainPage_t));
+	terrainPager.slotNode = (int *)malloc(terrainPager.slots * sizeof(int));
+	terrainPager.slotUsed = (int *)calloc(terrainPager.slots, sizeof(int));
+	terrainPager.slotState = new std::atomic<int>[terrainPager.slots];
+	if (!terrainPager.error || !terrainPager.minY || !terrainPager.maxY || !terrainPager.nodeSlot
+		|| !terrainPager.pages || !terrainPager.slotNode || !terrainPager.slotUsed) {
+		printf("Not enough memory for %d MB of terrain pages.\n", terrainPager.budget);
+		return terrainPagerFail();
+	}
+	if (fread(terrainPager.error, sizeof(float), terrainPager.nodes, terrainPager.file) != (size_t)terrainPager.nodes
+		|| fread(terrainPager.minY, sizeof(float), terrainPager.nodes, terrainPager.file) != (size_t)terrainPager.nodes
+		|| fread(terrainPager.maxY, sizeof(float), terrainPager.nodes, terrainPager.file) != (size_t)terrainPager.nodes) {
+		printf("%s is truncated.\n", terrainPager.filename);
+		return terrainPagerFail();
+	}
+	for (int n = 0; n < terrainPager.nodes; n++)
+		terrainPager.nodeSlot[n] = -1;
+	for (int s = 0; s < terrainPager.slots; s++) {
+		terrainPager.slotNode[s] = s < pinned ? s : -1;
+		terrainPager.slotState[s].store(s < pinned ? PAGE_READY : PAGE_FREE);
+		if (s < pinned) {
+			terrainPager.nodeSlot[s] = s;
+			terrainPager.slotUsed[s] = INT_MAX;
+			if (!terrainPageRead(s, &terrainPager.pages[s])) {
+				printf("%s is truncated.\n", terrainPager.filename);
+				return terrainPagerFail();
+			}
+		}
+	}
+	terrainPager.lock = new std::mutex;
+	terrainPager.wake = new std::condition_variable;
+	terrainPager.queue = new std::deque<int>;
+	std::thread(terrainPagerLoader).detach();
+
+	terrain.size = header.size;
+	terrain.worldSize = header.worldSize;
+	return true;
+}
+
+// a node's page if it is resident; otherwise ask the loader for it and return NULL
+const terrainPage_t *terrainPagerGet(int node) {
+	int slot = terrainPager.nodeSlot[node];
+	if (slot >= 0) {
+		if (terrainPager.slotState[slot].load(std::memory_order_acquire) != PAGE_READY)
+			return NULL;
+		if (terrainPager.slotUsed[slot] != INT_MAX)
+			terrainPager.slotUsed[slot] = terrainPager.frame;
+		return &terrainPager.pages[slot];
+	}
+	// take a free slot, or the ready page used longest ago and not in this frame
+	for (int s = 0; s < terrainPager.slots; s++) {
+		if (terrainPager.slotState[s].load(std::memory_order_acquire) == PAGE_LOADING)
+			continue;
+		if (terrainPager.slotNode[s] < 0) {
+			slot = s;
+			break;
+		}
+		if (terrainPager.slotUsed[s] < terrainPager.frame && (slot < 0 || terrainPager.slotUsed[s] < terrainPager.slotUsed[slot]))
+			slot = s;
+	}
+	if (slot < 0)
+		return NULL;
+	if (terrainPager.slotNode[slot] >= 0)
+		terrainPager.nodeSlot[terrainPager.slotNode[slot]] = -1;
+	terrainPager.nodeSlot[node] = slot;
+	terrainPager.slotUsed[slot] = terrainPager.frame;
+	terrainPager.slotState[slot].store(PAGE_LOADING);
+	terrainPager.loads++;
+	{
+		std::lock_guard<std::mutex> guard(*terrainPager.lock);
+		terrainPager.slotNode[slot] = node;
+		terrainPager.queue->push_back(slot);
+	}
+	terrainPager.wake->notify_one();
+	return NULL;
+}
+
+// height of a terrain sample from the finest resident page holding it
+GLfloat terrainPagedHeight(int i, int j) {
+	int last = terrain.size - 1;
+	i = i < 0 ? 0 : i > last ? last : i;
+	j = j < 0 ? 0 : j > last ? last : j;
+	const terrainPage_t *page = NULL;
+	int step = 0, x0 = 0, z0 = 0;
+	for (int level = 0; level <= terrainPager.depth; level++) {
+		int s = 1 << (terrainPager.depth - level), span = s * TERRAIN_PATCH;
+		int x = i / span, z = j / span;
+		int slot = terrainPager.nodeSlot[terrainLodNode(level, x, z)];
+		if (slot < 0 || terrainPager.slotState[slot].load(std::memory_order_acquire) != PAGE_READY)
+			break;
+		page = &terrainPager.pages[slot];
+		step = s;
+		x0 = x * span;
+		z0 = z * span;
+	}
+	// the nearest page sample
+	int a = (i - x0 + step / 2) / step, b = (j - z0 + step / 2) / step;
+	return page->height[b * TERRAIN_PAGE + a];
+}
+
+// a terrain sample whether the terrain is resident or paged
+GLfloat terrainHeight(int i, int j) {
+	return terrainResident() ? terrainAt(i, j) : terrainPagedHeight(i, j);
+}
+
+// load the heightmap given by --terrain or the pages given by --terrain-pages, generate the island
+// of --terrain-noise, or use the built in island without any of them
+bool terrainInit() {
+	if (terrainPager.filename)
+		return terrainPagerOpen();
+	if (terrainNoise.size)
+		return terrainNoiseBuild(true);
+	if (!terrain.filename)
+		return terrainBuild((const unsigned char *)islandHeight, SAMPLE_FLOAT, ISLAND_SIZE, ISLAND_SIZE, 1.0f);
+
+	const char *ext = strrchr(terrain.filename, '.');
+	if (ext && (!strcmp(ext, ".raw") || !strcmp(ext, ".r16")))
+		return terrainLoadMapped(terrain.filename, true);
+	if (ext && !strcmp(ext, ".pgm"))
+		return terrainLoadMapped(terrain.filename, false);
+
+	int w, h, channels;
+	unsigned char *image = SOIL_load_image(terrain.filename, &w, &h, &channels, SOIL_LOAD_L);
+	if (!image) {
+		printf("Failed to load heightmap %s: %s\n", terrain.filename, SOIL_last_result());
+		return false;
+	}
+	bool ok = terrainBuild(image, SAMPLE_U8, w, h, terrain.heightScale / 255.0f);
+	SOIL_free_image_data(image);
+	return ok;
+}
 
 typedef struct { GLfloat x, y, z; } vec3f;
 typedef struct { GLfloat x, z; } vec2f;
 typedef struct { vec3f p, v; } vec6f;
 
-vec6f island;
-vec6f particle[MAX_BOAT_NUM][PARTICLE_NUM];
+thread_local vec6f island;
+thread_local vec6f particle[MAX_BOAT_NUM][PARTICLE_NUM];
 
 typedef struct {
 	bool debug;
@@ -164,12 +1900,9 @@ typedef struct {
 
 	bool start; // start animation
 	bool go; // resume or stop animation
-	float startTime;
-	float stopTime; // animation stop time;
-	float resumeTime;
-	float pauseIntervel; // store all the paused time total
+	gameClock_t gameClock; // the time global.t follows
 
-	float lastFrameRateT;
+	float lastFrameRateT; // clockSeconds() of the last frame rate update
 	float frameRateInterval;
 	float frameRate;
 	int frames;
@@ -177,7 +1910,7 @@ typedef struct {
 
 	bool wireframeMode;
 
-	int next; // for tessellation, get the next element from height[]
+	int next; // for tessellation, get the next terrain sample
 	float step; // for tessellation, calculate the increment of x and z
 	float thetaStep; // the increment of theta for drawing cylinder
 
@@ -190,9 +1923,17 @@ typedef struct {
 	float boatStopR; // the distance that the boat cannon will hit the island with inital cannon ratation angle of 60 degrees
 	bool win;
 	bool loose;
+
+	int dirty; // DIRTY_* flags of derived data calc() has to rebuild
+	int waveVersion; // bumped whenever the wave model or its parameters change
+	int fortsHit; // forts of other islands hit at least once
+
+	float lastTickRateT; // clockSeconds() of the last tick rate update
+	float tickRate; // simulation ticks per second
+	int ticks;
 } global_t;
 
-global_t global = { false, 0.0f, 0.0f, false, false, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.2f, 0.0f, 0, 16, false, 0, 0.0f, 0.0f, float(M_PI / 6.0), 0.0f, 0.0f, 0, false, 0, 0.0f, false, false };
+thread_local global_t global = { false, 0.0f, 0.0f, false, false, { 0, 0, 0, 0.0 }, 0.0f, 0.2f, 0.0f, 0, 16, false, 0, 0.0f, 0.0f, float(M_PI / 6.0), 0.0f, 0.0f, 0, false, 0, 0.0f, false, false, DIRTY_ALL, 0, 0, 0.0f, 0.0f, 0 };
 
 typedef struct { float A, k, w; } sinewave;
 sinewave sw1 = { 0.6f, float(0.15 * M_PI), float(0.8 * M_PI) };
@@ -223,7 +1964,7 @@ typedef struct {
 	bool fire;
 } cannonball_t;
 
-cannonball_t ball[MAX_BOAT_NUM + 1];
+thread_local cannonball_t ball[MAX_BOAT_NUM + 1];
 
 typedef struct {
 	vec3f p;
@@ -244,7 +1985,7 @@ typedef struct {
 	bool initial;
 } boat_t;
 
-boat_t boat[MAX_BOAT_NUM];
+thread_local boat_t boat[MAX_BOAT_NUM];
 
 static GLuint loadTexture(const char *filename) {
 	GLuint tex = SOIL_load_OGL_texture(filename, SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_MIPMAPS | SOIL_FLAG_INVERT_Y);
@@ -279,6 +2020,288 @@ void calcSineWave(sinewave sw1, sinewave sw2, sinewave sw3, sinewave sw4, float
 	}
 }
 
+/************************************************************************************************
+ * Wave models
+ *
+ * The sea is produced by a wave model. The rendered mesh (calcSea) and the boat heights both
+ * sample the current model, so boats always float on the surface that is drawn.
+ * sample() has the same outputs as calcSineWave(): the height in y and, when dvs is set,
+ * the unit normal as (dydx, dy, dydz).
+ * update() brings the model to time t and is cheap to call more than once for the same t.
+ * period() is the length after which the surface repeats along x and z, 0 if it does not.
+ *************************************************************************************************/
+typedef struct {
+	const char *name;
+	bool (*init)();
+	void (*update)(float t);
+	void (*sample)(float x, float z, float t, float *y, bool dvs, float *dydx, float *dydz, float *dy);
+	float (*period)();
+} waveModel_t;
+
+bool sineInit() {
+	return true;
+}
+
+void sineUpdate(float t) {
+}
+
+void sineSample(float x, float z, float t, float *y, bool dvs, float *dydx, float *dydz, float *dy) {
+	calcSineWave(sw1, sw2, sw3, sw4, x, z, t, y, dvs, dydx, dydz, dy);
+}
+
+// shortest length holding a whole number of every wavelength, searched in steps of 0.01
+float sinePeriod() {
+	static float period = -1.0f;
+	if (period < 0.0f) {
+		float k[] = { sw1.k, sw2.k, sw3.k, sw4.k };
+		period = 0.0f;
+		for (int n = 1; n <= 100000 && period == 0.0f; n++) {
+			bool whole = true;
+			for (int w = 0; w < 4 && whole; w++) {
+				float waves = n * 0.01f * k[w] / (2.0 * M_PI);
+				whole = fabsf(waves - roundf(waves)) < 1e-3f;
+			}
+			if (whole)
+				period = n * 0.01f;
+		}
+	}
+	return period;
+}
+
+/************************************************************************************************
+ * Tessendorf FFT ocean
+ *
+ * A Phillips spectrum h0(k) is generated once from the wind parameters. Every update the
+ * spectrum is advanced to h(k, t) = h0(k) e^(iwt) + conj(h0(-k)) e^(-iwt) with w = sqrt(g|k|)
+ * and brought back to a height field by inverse FFT. Both h and the slope i*kx*h are real
+ * fields, so they share one complex FFT (h + i * sx); the z slope takes the second one.
+ * The result is an n x n periodic patch of ocean.size world units that tiles the sea.
+ *************************************************************************************************/
+typedef struct {
+	int n; // grid resolution, must be a power of two
+	float size; // patch size in world units
+	float updateRate; // FFT updates per second, 0 updates whenever time changes
+	float windSpeed;
+	float windAngle; // wind direction on the xz plane
+	float rms; // root mean square of the height the spectrum is scaled to
+	unsigned seed;
+	float lastT; // time of the last FFT update
+	float *h0Re, *h0Im; // initial spectrum
+	float *omega; // dispersion of each wave vector
+	float *aRe, *aIm, *bRe, *bIm; // FFT work buffers
+	float *height, *slopeX, *slopeZ; // the sampled patch
+} ocean_t;
+
+ocean_t ocean = { 64, 50.0f, 30.0f, 8.0f, 0.4f, 0.5f, 1, -1.0f };
+
+static unsigned oceanRandState;
+
+// uniform random number in (0, 1], independent of rand() so the game's random stream is not disturbed
+float oceanRand() {
+	oceanRandState = oceanRandState * 1664525u + 1013904223u;
+	return ((oceanRandState >> 8) + 1) / 16777216.0f;
+}
+
+// Box-Muller gaussian
+float oceanGauss() {
+	float u1 = oceanRand(), u2 = oceanRand();
+	return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * M_PI * u2);
+}
+
+// in place inverse FFT of n complex values spaced by stride, no normalisation
+void fft(float *re, float *im, int n, int stride) {
+	for (int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			float t = re[i * stride]; re[i * stride] = re[j * stride]; re[j * stride] = t;
+			t = im[i * stride]; im[i * stride] = im[j * stride]; im[j * stride] = t;
+		}
+	}
+	for (int len = 2; len <= n; len <<= 1) {
+		float ang = 2.0 * M_PI / len;
+		float wRe = cosf(ang), wIm = sinf(ang);
+		for (int i = 0; i < n; i += len) {
+			float cRe = 1.0f, cIm = 0.0f;
+			for (int k = 0; k < len / 2; k++) {
+				int a = (i + k) * stride, b = (i + k + len / 2) * stride;
+				float tRe = re[b] * cRe - im[b] * cIm;
+				float tIm = re[b] * cIm + im[b] * cRe;
+				re[b] = re[a] - tRe; im[b] = im[a] - tIm;
+				re[a] += tRe; im[a] += tIm;
+				float nRe = cRe * wRe - cIm * wIm;
+				cIm = cRe * wIm + cIm * wRe;
+				cRe = nRe;
+			}
+		}
+	}
+}
+
+// the rows, then the columns, each pass spread over the jobs
+void fft2d(float *re, float *im, int n) {
+	jobFor("ocean fft", n, 16, [=](int j0, int j1) {
+		for (int j = j0; j < j1; j++)
+			fft(re + j * n, im + j * n, n, 1);
+	});
+	jobFor("ocean fft", n, 16, [=](int i0, int i1) {
+		for (int i = i0; i < i1; i++)
+			fft(re + i, im + i, n, n);
+	});
+}
+
+// signed frequency index of FFT bin m
+int oceanFreq(int m) {
+	return m < ocean.n / 2 ? m : m - ocean.n;
+}
+
+// h(k, t) and its slopes for rows j0 to j1 of the spectrum
+void oceanSpectrum(float t, int j0, int j1) {
+	int n = ocean.n;
+	for (int j = j0; j < j1; j++) {
+		float kz = 2.0 * M_PI * oceanFreq(j) / ocean.size;
+		for (int i = 0; i < n; i++) {
+			float kx = 2.0 * M_PI * oceanFreq(i) / ocean.size;
+			int k = j * n + i;
+			int mk = ((n - j) & (n - 1)) * n + ((n - i) & (n - 1)); // index of -k
+			float c = cosf(ocean.omega[k] * t), s = sinf(ocean.omega[k] * t);
+			// h0(k) e^(iwt) + conj(h0(-k)) e^(-iwt)
+			float hRe = ocean.h0Re[k] * c - ocean.h0Im[k] * s + ocean.h0Re[mk] * c - ocean.h0Im[mk] * s;
+			float hIm = ocean.h0Re[k] * s + ocean.h0Im[k] * c - ocean.h0Re[mk] * s - ocean.h0Im[mk] * c;
+			// slopes are i * k * h; pack h + i * sx into a and sz into b
+			ocean.aRe[k] = hRe - kx * hRe;
+			ocean.aIm[k] = hIm - kx * hIm;
+			ocean.bRe[k] = -kz * hIm;
+			ocean.bIm[k] = kz * hRe;
+		}
+	}
+}
+
+// build h(k, t) and its slopes, then transform them to the spatial patch
+void oceanTransform(float t) {
+	int n = ocean.n;
+	jobFor("ocean spectrum", n, 16, [t](int j0, int j1) {
+		oceanSpectrum(t, j0, j1);
+	});
+	fft2d(ocean.aRe, ocean.aIm, n);
+	fft2d(ocean.bRe, ocean.bIm, n);
+	for (int k = 0; k < n * n; k++) {
+		ocean.height[k] = ocean.aRe[k];
+		ocean.slopeX[k] = ocean.aIm[k];
+		ocean.slopeZ[k] = ocean.bRe[k];
+	}
+}
+
+bool oceanInit() {
+	int n = ocean.n;
+	if (n < 2 || (n & (n - 1))) {
+		printf("Ocean grid resolution %d is not a power of two.\n", n);
+		return false;
+	}
+	if (ocean.h0Re)
+		return true;
+	float **buffers[] = { &ocean.h0Re, &ocean.h0Im, &ocean.omega, &ocean.aRe, &ocean.aIm, &ocean.bRe, &ocean.bIm, &ocean.height, &ocean.slopeX, &ocean.slopeZ };
+	for (unsigned b = 0; b < sizeof buffers / sizeof buffers[0]; b++) {
+		*buffers[b] = (float *)malloc(n * n * sizeof(float));
+		if (!*buffers[b]) {
+			printf("Out of memory for ocean grid %d x %d.\n", n, n);
+			return false;
+		}
+	}
+
+	// Phillips spectrum
+	oceanRandState = ocean.seed;
+	float L = ocean.windSpeed * ocean.windSpeed / -G; // largest wave from the wind speed
+	float l = L / 1000.0f; // suppress waves much smaller than that
+	float wx = cosf(ocean.windAngle), wz = sinf(ocean.windAngle);
+	for (int j = 0; j < n; j++) {
+		float kz = 2.0 * M_PI * oceanFreq(j) / ocean.size;
+		for (int i = 0; i < n; i++) {
+			float kx = 2.0 * M_PI * oceanFreq(i) / ocean.size;
+			float k2 = kx * kx + kz * kz;
+			float p = 0.0f;
+			if (k2 > 0.0f) {
+				float kw = (kx * wx + kz * wz) / sqrtf(k2);
+				p = expf(-1.0f / (k2 * L * L)) / (k2 * k2) * kw * kw * expf(-k2 * l * l);
+			}
+			float a = sqrtf(p * 0.5f);
+			if (i == n / 2 || j == n / 2)
+				a = 0.0f; // the Nyquist bins have no conjugate partner
+			ocean.h0Re[j * n + i] = oceanGauss() * a;
+			ocean.h0Im[j * n + i] = oceanGauss() * a;
+			ocean.omega[j * n + i] = sqrtf(-G * sqrtf(k2));
+		}
+	}
+
+	// scale the spectrum to the requested wave height
+	oceanTransform(0.0f);
+	double sum = 0.0;
+	for (int k = 0; k < n * n; k++)
+		sum += ocean.height[k] * ocean.height[k];
+	float rms = sqrt(sum / (n * n));
+	float scale = rms > 0.0f ? ocean.rms / rms : 0.0f;
+	for (int k = 0; k < n * n; k++) {
+		ocean.h0Re[k] *= scale;
+		ocean.h0Im[k] *= scale;
+	}
+	ocean.lastT = -1.0f;
+	return true;
+}
+
+void oceanFree() {
+	float **buffers[] = { &ocean.h0Re, &ocean.h0Im, &ocean.omega, &ocean.aRe, &ocean.aIm, &ocean.bRe, &ocean.bIm, &ocean.height, &ocean.slopeX, &ocean.slopeZ };
+	for (unsigned b = 0; b < sizeof buffers / sizeof buffers[0]; b++) {
+		free(*buffers[b]);
+		*buffers[b] = NULL;
+	}
+}
+
+void oceanUpdate(float t) {
+	if (t == ocean.lastT)
+		return;
+	if (ocean.lastT >= 0.0f && ocean.updateRate > 0.0f && t >= ocean.lastT && t - ocean.lastT < 1.0f / ocean.updateRate)
+		return;
+	oceanTransform(t);
+	ocean.lastT = t;
+}
+
+// bilinear lookup in the periodic patch; t is taken from the last update
+void oceanSample(float x, float z, float t, float *y, bool dvs, float *dydx, float *dydz, float *dy) {
+	int n = ocean.n;
+	float u = x / ocean.size * n, v = z / ocean.size * n;
+	float fu = floorf(u), fv = floorf(v);
+	float du = u - fu, dv = v - fv;
+	int i0 = (int)fu & (n - 1), j0 = (int)fv & (n - 1);
+	int i1 = (i0 + 1) & (n - 1), j1 = (j0 + 1) & (n - 1);
+	float w00 = (1.0f - du) * (1.0f - dv), w10 = du * (1.0f - dv), w01 = (1.0f - du) * dv, w11 = du * dv;
+	int k00 = j0 * n + i0, k10 = j0 * n + i1, k01 = j1 * n + i0, k11 = j1 * n + i1;
+	*y = w00 * ocean.height[k00] + w10 * ocean.height[k10] + w01 * ocean.height[k01] + w11 * ocean.height[k11];
+	if (dvs) {
+		float sx = w00 * ocean.slopeX[k00] + w10 * ocean.slopeX[k10] + w01 * ocean.slopeX[k01] + w11 * ocean.slopeX[k11];
+		float sz = w00 * ocean.slopeZ[k00] + w10 * ocean.slopeZ[k10] + w01 * ocean.slopeZ[k01] + w11 * ocean.slopeZ[k11];
+		float s = sqrtf(sx * sx + sz * sz + 1.0f);
+		*dydx = -sx / s;
+		*dydz = -sz / s;
+		*dy = 1.0f / s;
+	}
+}
+
+float oceanPeriod() {
+	return ocean.size;
+}
+
+waveModel_t sineWaveModel = { "sine", sineInit, sineUpdate, sineSample, sinePeriod };
+waveModel_t fftWaveModel = { "fft", oceanInit, oceanUpdate, oceanSample, oceanPeriod };
+waveModel_t *waveModels[] = { &sineWaveModel, &fftWaveModel };
+#define WAVE_MODEL_NUM int(sizeof waveModels / sizeof waveModels[0])
+waveModel_t *waveModel = &sineWaveModel;
+
+// sea height (and normal) at x, z from the current wave model
+void calcSeaWave(float x, float z, float t, float *y, bool dvs, float *dydx, float *dydz, float *dy) {
+	waveModel->sample(x, z, t, y, dvs, dydx, dydz, dy);
+}
+
 // using numeric formular to calculate y of parabola
 vec6f calcParabola(vec6f pv, float dt) {
 	pv.p.x += pv.v.x * dt;
@@ -304,27 +2327,171 @@ vec3f calcActualPositionIsland(vec3f p) {
 	return p;
 }
 
+/************************************************************************************************
+ * Islands
+ *
+ * The world holds world.count islands, all built from the one terrain. Island 0 is the player's,
+ * at the origin as before. --islands N places the others on a jittered lattice around it, each at
+ * its own position and heading with a fort of its own, from the --island-seed random stream.
+ * The other forts are targets: any cannonball that reaches one stops there, and the player's
+ * are counted against it. Hits on the player's own fort go through the same lookup.
+ *
+ * Height queries, hit tests and ray casts find islands through a uniform grid of world.cell wide
+ * cells holding one lattice point each. The jitter keeps the circle around an island inside its
+ * cell, so a point is looked up in one cell and a segment in the cells its bounding box covers,
+ * however many islands there are.
+ *************************************************************************************************/
+#define MAX_ISLANDS 4096
+
+typedef struct {
+	vec3f p; // centre of the island; p.y lifts it and its fort
+	float angleY; // heading of the terrain
+	float c, s; // cosine and sine of angleY
+	float fortAngleY; // heading of the fort, its cannon facing the origin
+	int hitCount; // cannonballs that reached the fort
+} islandSite_t;
+
+typedef struct {
+	int count; // islands including the player's
+	unsigned seed;
+	islandSite_t *sites;
+	float radius; // of the circle around an island's terrain
+	float cell; // broadphase cell size
+	int cells; // cells per side
+	float origin; // x and z of the corner of the first cell
+	int *cellSite; // the island in each cell, -1 for none
+} world_t;
+
+world_t world = { 1, 1 };
+
+static unsigned worldRandState;
+
+// uniform random number in [0, 1), like oceanRand() independent of rand()
+float worldRand() {
+	worldRandState = worldRandState * 1664525u + 1013904223u;
+	return (worldRandState >> 8) / 16777216.0f;
+}
+
+bool worldInit() {
+	if (world.count < 1 || world.count > MAX_ISLANDS) {
+		printf("The world holds 1 to %d islands.\n", MAX_ISLANDS);
+		return false;
+	}
+	world.radius = terrain.worldSize * sqrtf(0.5f);
+	world.cell = world.radius * 2.5f;
+	int rings = 0;
+	while ((2 * rings + 1) * (2 * rings + 1) < world.count)
+		rings++;
+	world.cells = 2 * rings + 1;
+	world.origin = -(rings + 0.5f) * world.cell;
+	world.sites = (islandSite_t *)calloc(world.count, sizeof(islandSite_t));
+	world.cellSite = (int *)malloc(world.cells * world.cells * sizeof(int));
+	if (!world.sites || !world.cellSite) {
+		printf("Not enough memory for %d islands.\n", world.count);
+		return false;
+	}
+	for (int c = 0; c < world.cells * world.cells; c++)
+		world.cellSite[c] = -1;
+
+	// fill the lattice ring by ring outwards from the player's island
+	worldRandState = world.seed;
+	float jitter = (world.cell - 2.0f * world.radius) / 3.0f;
+	int k = 0;
+	for (int r = 0; r <= rings; r++) {
+		for (int z = -r; z <= r && k < world.count; z++) {
+			for (int x = -r; x <= r && k < world.count; x++) {
+				if (abs(x) != r && abs(z) != r)
+					continue;
+				islandSite_t *s = &world.sites[k];
+				if (k > 0) {
+					s->p.x = x * world.cell + (2.0f * worldRand() - 1.0f) * jitter;
+					s->p.z = z * world.cell + (2.0f * worldRand() - 1.0f) * jitter;
+					s->angleY = worldRand() * 2.0f * M_PI;
+					s->fortAngleY = atan2f(s->p.x, s->p.z);
+				}
+				s->c = cosf(s->angleY);
+				s->s = sinf(s->angleY);
+				world.cellSite[(z + rings) * world.cells + x + rings] = k++;
+			}
+		}
+	}
+	return true;
+}
+
+// world point p in the coordinates of island s
+vec3f worldToIsland(const islandSite_t *s, vec3f p) {
+	float dx = p.x - s->p.x, dz = p.z - s->p.z;
+	vec3f q = { s->c * dx - s->s * dz, p.y - s->p.y, s->s * dx + s->c * dz };
+	return q;
+}
+
+// broadphase cell of a world coordinate, clamped to the grid
+int worldCell(float x) {
+	int c = (int)floorf((x - world.origin) / world.cell);
+	return c < 0 ? 0 : c >= world.cells ? world.cells - 1 : c;
+}
+
+// the island whose terrain is under p, with p in its coordinates in q; -1 over the sea
+int worldSiteAt(vec3f p, vec3f *q) {
+	int k = world.cellSite[worldCell(p.z) * world.cells + worldCell(p.x)];
+	if (k < 0)
+		return -1;
+	*q = worldToIsland(&world.sites[k], p);
+	if (fabsf(q->x) > terrain.worldSize / 2.0 || fabsf(q->z) > terrain.worldSize / 2.0)
+		return -1;
+	return k;
+}
+
+// the island whose fort a cannonball at p is in, -1 for none
+int worldFortAt(vec3f p) {
+	vec3f q;
+	int k = worldSiteAt(p, &q);
+	if (k >= 0 && q.x * q.x + q.z * q.z < (FORT_R + FORT_BASE_H + BALL_R) * (FORT_R + FORT_BASE_H + BALL_R)
+		&& fabsf(q.y - FORT_CENTER) < 0.75)
+		return k;
+	return -1;
+}
+
+// count the player's cannonball at p against the fort of another island; true if it reached one
+bool worldHitFort(vec3f p) {
+	int k = worldFortAt(p);
+	if (k <= 0)
+		return false;
+	if (!world.sites[k].hitCount++)
+		global.fortsHit++;
+	return true;
+}
+
+// height of the terrain cell under p, or of the sea level off the terrain
+float calcHeightTerrain(vec3f p) {
+	if (fabsf(p.x) > terrain.worldSize / 2.0 || fabsf(p.z) > terrain.worldSize / 2.0)
+		return -2.0f;
+	int i = (terrain.size - 1) / 2 + (int)floorf(p.x / terrain.worldSize * (terrain.size - 1));
+	int j = (terrain.size - 1) / 2 + (int)floorf(p.z / terrain.worldSize * (terrain.size - 1));
+	return -2.0 + terrainHeight(i, j);
+}
+
 float calcHeight(vec3f p) {
 	for (int i = 0; i < MAX_BOAT_NUM; i++)
 		if (fabsf(p.x - boat[i].p.x) < 1.0 && fabsf(p.z - boat[i].p.z) < 1.0 && !boat[i].isHit)
 			return boat[i].p.y;
-	if (fabsf(p.x) > RANGE / 2.0 || fabsf(p.z) > RANGE / 2.0)
+	vec3f q;
+	int k = worldSiteAt(p, &q);
+	if (k < 0)
 		return -2.0f;
-	int i = MAX_TESSELLATION / 2 + (int)floorf(p.x / RANGE * MAX_TESSELLATION);
-	int j = MAX_TESSELLATION / 2 + (int)floorf(p.z / RANGE * MAX_TESSELLATION);
-	if (p.x * p.x + p.z * p.z < FORT_R * FORT_R) {
-		if (p.x * p.x + p.z * p.z < 0.5 * 0.5)
-			return -2.0 + FORT_BASE_H + 0.5 + height[(j + MAX_TESSELLATION / MIN_TESSELLATION) * LENGTH_HEIGHT + i + MAX_TESSELLATION / MIN_TESSELLATION];
-		return -2.0 + FORT_BASE_H + height[(j + MAX_TESSELLATION / MIN_TESSELLATION) * LENGTH_HEIGHT + i + MAX_TESSELLATION / MIN_TESSELLATION];
+	float y = world.sites[k].p.y;
+	if (q.x * q.x + q.z * q.z < FORT_R * FORT_R) {
+		if (q.x * q.x + q.z * q.z < 0.5 * 0.5)
+			return y + FORT_BASE_H + 0.5 + calcHeightTerrain(q);
+		return y + FORT_BASE_H + calcHeightTerrain(q);
 	}
 	else
-		return -2.0 + height[(j + MAX_TESSELLATION / MIN_TESSELLATION) * LENGTH_HEIGHT + i + MAX_TESSELLATION / MIN_TESSELLATION];
+		return y + calcHeightTerrain(q);
 }
 
 int checkHit(vec6f pv) {
 	if (pv.v.y < 0) {
-		if (pv.p.x * pv.p.x + pv.p.z * pv.p.z < (FORT_R + FORT_BASE_H + BALL_R) * (FORT_R + FORT_BASE_H + BALL_R)
-			&& fabsf(pv.p.y - FORT_CENTER) < 0.75) {
+		if (worldFortAt(pv.p) == 0) {
 			return ISLAND;
 		} else {
 			for (int i = 0; i < MAX_BOAT_NUM; i++) {
@@ -350,11 +2517,209 @@ int predictHit(vec6f pv) {
 	return -1;
 }
 
+/************************************************************************************************
+ * Terrain ray casts
+ *
+ * calcHeight() sees the terrain as flat cells, one per sample, so a cannonball sampled every
+ * 35 ms can pass through a peak narrower than a step. terrainCast() finds exactly where a
+ * straight segment first goes below that surface. It walks a pyramid of the lowest and highest
+ * sample of every 2^level x 2^level block of cells front to back, skipping any block the
+ * segment stays above and stopping at the first block it stays below, so only blocks near the
+ * surface are opened. A cast costs about the log of the map size instead of one step per cell.
+ * Levels under TERRAIN_PYRAMID_BASE are read from the terrain, keeping the pyramid to a sixth
+ * of the size of the terrain; for quantised terrain the base is one level up, keeping it to a
+ * twelfth. Paged terrain has no pyramid and is only sampled.
+ *************************************************************************************************/
+#define TERRAIN_PYRAMID_BASE 2 // finest stored level
+#define TERRAIN_PYRAMID_BASE_QUANTISED 3
+
+typedef struct {
+	int levels; // the root block at level levels - 1 covers the terrain
+	int base; // finest stored level
+	float *minY[32], *maxY[32]; // per level from base, rows of (size + 2^level - 1) >> level blocks
+} terrainPyramid_t;
+
+terrainPyramid_t terrainPyramid;
+thread_local int terrainCasts, terrainCastNodes; // for benchmarks, counted by each thread
+
+int terrainPyramidWidth(int level) {
+	return (terrain.size + (1 << level) - 1) >> level;
+}
+
+// lowest and highest sample of the four children of a block
+void terrainPyramidChildren(int level, int x, int z, float *lo, float *hi);
+
+// lowest and highest sample of a block
+void terrainPyramidRange(int level, int x, int z, float *lo, float *hi) {
+	if (level == 0) {
+		*lo = *hi = terrainAt(x, z);
+	} else if (level < terrainPyramid.base) {
+		terrainPyramidChildren(level, x, z, lo, hi);
+	} else {
+		int k = z * terrainPyramidWidth(level) + x;
+		*lo = terrainPyramid.minY[level][k];
+		*hi = terrainPyramid.maxY[level][k];
+	}
+}
+
+void terrainPyramidChildren(int level, int x, int z, float *lo, float *hi) {
+	*lo = 1e30f;
+	*hi = -1e30f;
+	int w = terrainPyramidWidth(level - 1);
+	for (int c = 0; c < 4; c++) {
+		int cx = 2 * x + (c & 1), cz = 2 * z + (c >> 1);
+		if (cx >= w || cz >= w)
+			continue;
+		float clo, chi;
+		terrainPyramidRange(level - 1, cx, cz, &clo, &chi);
+		*lo = clo < *lo ? clo : *lo;
+		*hi = chi > *hi ? chi : *hi;
+	}
+}
+
+// build the pyramid over the resident terrain, each level from the one below
+bool terrainPyramidInit() {
+	for (int level = terrainPyramid.base; level < terrainPyramid.levels; level++) {
+		free(terrainPyramid.minY[level]);
+		free(terrainPyramid.maxY[level]);
+	}
+	terrainPyramid.levels = 0;
+	if (!terrainResident())
+		return true;
+	terrainPyramid.base = terrain.samples ? TERRAIN_PYRAMID_BASE_QUANTISED : TERRAIN_PYRAMID_BASE;
+	terrainPyramid.levels = 1;
+	while ((1 << (terrainPyramid.levels - 1)) < terrain.size)
+		terrainPyramid.levels++;
+	for (int level = terrainPyramid.base; level < terrainPyramid.levels; level++) {
+		int w = terrainPyramidWidth(level);
+		terrainPyramid.minY[level] = (float *)malloc((size_t)w * w * sizeof(float));
+		terrainPyramid.maxY[level] = (float *)malloc((size_t)w * w * sizeof(float));
+		if (!terrainPyramid.minY[level] || !terrainPyramid.maxY[level]) {
+			printf("Not enough memory for the terrain height pyramid.\n");
+			return false;
+		}
+		for (int z = 0; z < w; z++)
+			for (int x = 0; x < w; x++)
+				terrainPyramidChildren(level, x, z, &terrainPyramid.minY[level][z * w + x], &terrainPyramid.maxY[level][z * w + x]);
+	}
+	return true;
+}
+
+// a segment in cell coordinates, with heights relative to the terrain samples
+typedef struct {
+	float u, v, y; // start
+	float du, dv, dy; // end - start
+	float t; // of the first hit, 0 at the start and 1 at the end
+} terrainRay_t;
+
+// narrow [tin, tout] to where the ray is over cells [x0, x1) x [z0, z1); false if it never is
+bool terrainRayClip(const terrainRay_t *r, float x0, float x1, float z0, float z1, float *tin, float *tout) {
+	float lo[2] = { x0, z0 }, hi[2] = { x1, z1 }, p[2] = { r->u, r->v }, d[2] = { r->du, r->dv };
+	for (int a = 0; a < 2; a++) {
+		if (d[a] == 0.0f) {
+			if (p[a] < lo[a] || p[a] > hi[a])
+				return false;
+			continue;
+		}
+		float ta = (lo[a] - p[a]) / d[a], tb = (hi[a] - p[a]) / d[a];
+		*tin = fmaxf(*tin, fminf(ta, tb));
+		*tout = fminf(*tout, fmaxf(ta, tb));
+	}
+	return *tin <= *tout;
+}
+
+// first hit of the ray with the block in [tin, tout], looking into children nearest first
+bool terrainCastBlock(terrainRay_t *r, int level, int x, int z, float tin, float tout) {
+	terrainCastNodes++;
+	float lo, hi;
+	terrainPyramidRange(level, x, z, &lo, &hi);
+	float yin = r->y + r->dy * tin, yout = r->y + r->dy * tout;
+	if (yin >= hi && yout >= hi)
+		return false;
+	if (yin < lo) {
+		// below every sample of the block as it enters, so below the first cell it enters
+		r->t = tin;
+		return true;
+	}
+	if (level == 0) {
+		// falls through the top of the cell
+		r->t = tin + (tout - tin) * (yin - hi) / (yin - yout);
+		return true;
+	}
+	int count = 0, cx[4], cz[4], s = 1 << (level - 1), w = terrainPyramidWidth(level - 1);
+	float ti[4], to[4];
+	for (int c = 0; c < 4; c++) {
+		int bx = 2 * x + (c & 1), bz = 2 * z + (c >> 1);
+		float a = tin, b = tout;
+		if (bx >= w || bz >= w || !terrainRayClip(r, bx * s, fminf((bx + 1) * s, terrain.size - 1), bz * s, fminf((bz + 1) * s, terrain.size - 1), &a, &b))
+			continue;
+		// keep the children in the order the ray enters them
+		int k = count++;
+		for (; k > 0 && ti[k - 1] > a; k--) {
+			ti[k] = ti[k - 1];
+			to[k] = to[k - 1];
+			cx[k] = cx[k - 1];
+			cz[k] = cz[k - 1];
+		}
+		ti[k] = a;
+		to[k] = b;
+		cx[k] = bx;
+		cz[k] = bz;
+	}
+	for (int k = 0; k < count; k++)
+		if (terrainCastBlock(r, level - 1, cx[k], cz[k], ti[k], to[k]))
+			return true;
+	return false;
+}
+
+// where the segment from a to b in island coordinates first goes below the terrain cells, as a
+// fraction t of the way; false if it does not or the terrain has no pyramid
+bool terrainCast(vec3f a, vec3f b, float *t) {
+	if (!terrainPyramid.levels)
+		return false;
+	terrainCasts++;
+	float cells = (terrain.size - 1) / terrain.worldSize, centre = (terrain.size - 1) / 2;
+	terrainRay_t r = { a.x * cells + centre, a.z * cells + centre, a.y + 2.0f, (b.x - a.x) * cells, (b.z - a.z) * cells, b.y - a.y, 0.0f };
+	float tin = 0.0f, tout = 1.0f;
+	if (!terrainRayClip(&r, 0.0f, terrain.size - 1, 0.0f, terrain.size - 1, &tin, &tout)
+		|| !terrainCastBlock(&r, terrainPyramid.levels - 1, 0, 0, tin, tout))
+		return false;
+	*t = r.t;
+	return true;
+}
+
+// terrainCast() for a segment in world coordinates against every island it passes over
+bool worldCast(vec3f a, vec3f b, float *t) {
+	int i0 = worldCell(fminf(a.x, b.x)), i1 = worldCell(fmaxf(a.x, b.x));
+	int j0 = worldCell(fminf(a.z, b.z)), j1 = worldCell(fmaxf(a.z, b.z));
+	bool hit = false;
+	for (int j = j0; j <= j1; j++) {
+		for (int i = i0; i <= i1; i++) {
+			int k = world.cellSite[j * world.cells + i];
+			float tk;
+			if (k >= 0 && terrainCast(worldToIsland(&world.sites[k], a), worldToIsland(&world.sites[k], b), &tk) && (!hit || tk < *t)) {
+				*t = tk;
+				hit = true;
+			}
+		}
+	}
+	return hit;
+}
+
 vec6f finalPointWhenParabolaTouchObject(vec6f pv) {
-	do {
-		pv = calcParabola(pv, 0.035);
-	} while (pv.p.y > calcHeight(calcActualPositionIsland(pv.p)));
-	return pv;
+	for (;;) {
+		vec6f next = calcParabola(pv, 0.035);
+		float t;
+		// stop where the step first goes into the terrain, even between samples
+		if (worldCast(calcActualPositionIsland(pv.p), calcActualPositionIsland(next.p), &t)) {
+			pv.p = { pv.p.x + (next.p.x - pv.p.x) * t, pv.p.y + (next.p.y - pv.p.y) * t, pv.p.z + (next.p.z - pv.p.z) * t };
+			pv.v = { pv.v.x + (next.v.x - pv.v.x) * t, pv.v.y + (next.v.y - pv.v.y) * t, pv.v.z + (next.v.z - pv.v.z) * t };
+			return pv;
+		}
+		pv = next;
+		if (pv.p.y <= calcHeight(calcActualPositionIsland(pv.p)))
+			return pv;
+	}
 }
 
 void calcNormalCylinderSide() {
@@ -364,71 +2729,175 @@ void calcNormalCylinderSide() {
 			cylinderSideNormals[j * global.tessellation * 3 + i * 3 + 1] = 0.0;
 			cylinderSideNormals[j * global.tessellation * 3 + i * 3 + 2] = sinf(i * global.thetaStep);
 		}
-	}
+	}
+}
+
+void calcNormalFort() {
+	for (int i = 0; i < global.tessellation / 2 + 3; i++) {
+		fortLeftNormals[i * 3] = -1.0;
+		fortLeftNormals[i * 3 + 1] = fortLeftNormals[i * 3 + 2] = 0.0;
+		fortRightNormals[i * 3] = 1.0;
+		fortRightNormals[i * 3 + 1] = fortRightNormals[i * 3 + 2] = 0.0;
+	}
+}
+
+// normals of the island mesh at tess quads a side, next terrain samples apart; reads no game
+// state, so it runs on any thread
+void calcNormalIsland(int tess, int next) {
+	jobFor("island normals", tess + 1, 8, [tess, next](int j0, int j1) {
+		vec3f normal = { 0.0, 0.0, 0.0 };
+		for (int j = j0; j < j1; j++) {
+			for (int i = 0; i < tess + 1; i++) {
+				int m = i * next, n = j * next;
+				float hL = terrainClamped(m - next, n);
+				float hR = terrainClamped(m + next, n);
+				float hD = terrainClamped(m, n - next);
+				float hU = terrainClamped(m, n + next);
+				normal.x = hL - hR;
+				normal.z = hD - hU;
+				normal.y = 2.0 * terrain.worldSize / RANGE;
+				normal = normalize(normal);
+				islandNormals[j * 3 * (tess + 1) + i * 3] = normal.x * RATIO;
+				islandNormals[j * 3 * (tess + 1) + i * 3 + 1] = normal.y * RATIO;
+				islandNormals[j * 3 * (tess + 1) + i * 3 + 2] = normal.z * RATIO;
+			}
+		}
+	});
+}
+
+/************************************************************************************************
+ * Normal mapped sea
+ *
+ * Analytic per vertex normals need a fine grid to look smooth. In normal map mode the sea grid
+ * is seaNormalMap.coarseness times coarser and the lighting comes from a normal texture
+ * generated from the wave model whenever the sea changes. The texture covers one period of the
+ * surface, so it tiles, and holds world space normals that a fragment shader lights per pixel.
+ * Boats still sample the coarse grid, so they sit on the surface that is drawn.
+ *************************************************************************************************/
+typedef struct {
+	bool enabled;
+	int coarseness; // the sea grid is tessellation * 6 / coarseness
+	int size; // normal texture resolution
+	GLuint program, texture;
+	GLint uPeriod;
+	int version; // sea grid tick the texture was uploaded for
+	GLubyte *texels;
+	int texelVersion; // sea grid tick texels were generated for
+} seaNormalMap_t;
+
+seaNormalMap_t seaNormalMap = { false, 6, 128 };
+
+// resolution of the sea grid
+int seaGridTess() {
+	if (seaNormalMap.enabled)
+		return global.tessellation * 6 / seaNormalMap.coarseness > 2 ? global.tessellation * 6 / seaNormalMap.coarseness : 2;
+	return global.tessellation * 6;
+}
+
+// the sea grid at time t, tess quads a side, into vertices and normals, filled by whichever
+// threads run the rows
+void calcSea(float t, int tess, GLfloat *vertices, GLfloat *normals) {
+	float xStep = RANGE_SEA / tess;
+	float zStep = RANGE_SEA / tess;
+	jobFor("sea grid", tess + 1, 16, [=](int j0, int j1) {
+		float x, y, z, dydx, dydz, dy;
+		for (int j = j0; j < j1; j++) {
+			z = -RANGE_SEA / 2.0 + j * zStep;
+			for (int i = 0; i < tess + 1; i++) {
+				x = -RANGE_SEA / 2.0 + i * xStep;
+				calcSeaWave(x, z, t, &y, true, &dydx, &dydz, &dy);
+				normals[(j * (tess + 1) + i) * 3] = dydx;
+				normals[(j * (tess + 1) + i) * 3 + 1] = dy;
+				normals[(j * (tess + 1) + i) * 3 + 2] = dydz;
+				vertices[(j * (tess + 1) + i) * 3] = x;
+				vertices[(j * (tess + 1) + i) * 3 + 1] = y;
+				vertices[(j * (tess + 1) + i) * 3 + 2] = z;
+			}
+		}
+	});
 }
 
-void calcNormalFort() {
-	for (int i = 0; i < global.tessellation / 2 + 3; i++) {
-		fortLeftNormals[i * 3] = -1.0;
-		fortLeftNormals[i * 3 + 1] = fortLeftNormals[i * 3 + 2] = 0.0;
-		fortRightNormals[i * 3] = 1.0;
-		fortRightNormals[i * 3 + 1] = fortRightNormals[i * 3 + 2] = 0.0;
-	}
+/************************************************************************************************
+ * Sea height service
+ *
+ * Boat heights are read from the sea grid calcSea() built for the current time by bilinear
+ * lookup instead of evaluating the wave model again. Points off the grid fall back to the
+ * wave model. The grid is rebuilt at most once per change of time, tessellation or wave model,
+ * and every rebuild starts a new tick. Each entity keeps its answer for the tick, so asking
+ * again for the same boat at the same place costs a compare.
+ *************************************************************************************************/
+typedef struct { int tick; float x, z, y; } seaHeightCache_t;
+
+typedef struct {
+	int tick; // sea grid version
+	float gridT; // time the grid was built for
+	int gridTess; // grid resolution the grid was built with
+	int gridWaveVersion; // global.waveVersion the grid was built with
+	seaHeightCache_t entity[MAX_BOAT_NUM + 1];
+} seaHeight_t;
+
+thread_local seaHeight_t seaHeight = { 0, -1.0f, 0, -1 };
+
+// the work that brings this thread's sea grid to the current time, tessellation and wave model,
+// nothing if it is there already. The work reads no game state, so it can run as a job on any
+// thread, but the grid counts as rebuilt from now on and must not be read before it is done
+std::function<void()> seaGridBuild() {
+	if (seaHeight.gridT == global.t && seaHeight.gridTess == seaGridTess() && seaHeight.gridWaveVersion == global.waveVersion)
+		return [] {};
+	float t = global.t;
+	int tess = seaGridTess();
+	waveModel_t *model = waveModel;
+	GLfloat *vertices = seaVertices, *normals = seaNormals;
+	seaHeight.gridT = t;
+	seaHeight.gridTess = tess;
+	seaHeight.gridWaveVersion = global.waveVersion;
+	seaHeight.tick++;
+	return [=] {
+		model->update(t);
+		calcSea(t, tess, vertices, normals);
+	};
 }
 
-void calcNormalIsland() {
-	vec3f normal = { 0.0, 0.0, 0.0 };
-	for (int j = 0; j < global.tessellation + 1; j++) {
-		for (int i = 0; i < global.tessellation + 1; i++) {
-			int n = (j * global.next + MAX_TESSELLATION / MIN_TESSELLATION) * LENGTH_HEIGHT + i * global.next + MAX_TESSELLATION / MIN_TESSELLATION;
-			float hL = height[n - global.next];
-			float hR = height[n + global.next];
-			float hD = height[n - global.next * LENGTH_HEIGHT];
-			float hU = height[n + global.next * LENGTH_HEIGHT];
-			normal.x = hL - hR;
-			normal.z = hD - hU;
-			normal.y = 2.0;
-			normal = normalize(normal);
-			islandNormals[j * 3 * (global.tessellation + 1) + i * 3] = normal.x * RATIO;
-			islandNormals[j * 3 * (global.tessellation + 1) + i * 3 + 1] = normal.y * RATIO;
-			islandNormals[j * 3 * (global.tessellation + 1) + i * 3 + 2] = normal.z * RATIO;
-		}
+// make sure the sea grid matches the current time, tessellation and wave model
+void seaGridUpdate() {
+	seaGridBuild()();
+}
+
+// sea height at x, z without caching
+float seaHeightAt(float x, float z) {
+	int tess = seaHeight.gridTess;
+	float u = (x + RANGE_SEA / 2.0) / RANGE_SEA * tess;
+	float v = (z + RANGE_SEA / 2.0) / RANGE_SEA * tess;
+	if (u < 0.0f || v < 0.0f || u >= tess || v >= tess) {
+		float y;
+		calcSeaWave(x, z, global.t, &y, false, NULL, NULL, NULL);
+		return y;
 	}
+	int i = (int)u, j = (int)v;
+	float du = u - i, dv = v - j;
+	const GLfloat *row0 = seaVertices + (j * (tess + 1) + i) * 3 + 1;
+	const GLfloat *row1 = row0 + (tess + 1) * 3;
+	return (1.0f - dv) * ((1.0f - du) * row0[0] + du * row0[3]) + dv * ((1.0f - du) * row1[0] + du * row1[3]);
 }
 
-void calcSea() {
-	int tess = global.tessellation * 6;
-	float xStep = RANGE_SEA / tess;
-	float zStep = RANGE_SEA / tess;
-	float x, y, z, dydx, dydz, dy;
-	for (int j = 0; j < tess + 1; j++) {
-		z = -RANGE_SEA / 2.0 + j * zStep;
-		glBegin(GL_TRIANGLE_STRIP);
-		for (int i = 0; i < tess + 1; i++) {
-			x = -RANGE_SEA / 2.0 + i * xStep;
-			calcSineWave(sw1, sw2, sw3, sw4, x, z, global.t, &y, true, &dydx, &dydz, &dy);
-			seaNormals[(j * (tess + 1) + i) * 3] = dydx;
-			seaNormals[(j * (tess + 1) + i) * 3 + 1] = dy;
-			seaNormals[(j * (tess + 1) + i) * 3 + 2] = dydz;
-			seaVertices[(j * (tess + 1) + i) * 3] = x;
-			seaVertices[(j * (tess + 1) + i) * 3 + 1] = y;
-			seaVertices[(j * (tess + 1) + i) * 3 + 2] = z;
-		}
-		glEnd();
+// sea height for an entity (boat index), memoised for the current tick
+float seaHeightEntity(int entity, float x, float z) {
+	seaGridUpdate();
+	seaHeightCache_t *c = &seaHeight.entity[entity];
+	if (c->tick != seaHeight.tick || c->x != x || c->z != z) {
+		c->tick = seaHeight.tick;
+		c->x = x;
+		c->z = z;
+		c->y = seaHeightAt(x, z);
 	}
+	return c->y;
 }
 
-void calc() {
-	global.next = MAX_TESSELLATION / global.tessellation;
-	global.step = RANGE / global.tessellation;
-	global.thetaStep = M_PI * 2.0 / global.tessellation;
-	island.p = { ISLAND_BALL_X, ISLAND_BALL_Y, ISLAND_BALL_Z };
-	island.v = { ISLAND_BALL_VX, ISLAND_BALL_VY, ISLAND_BALL_VZ };
-	global.boatStopR = calcDistanceBoatHitIsland() - 2.0 * FORT_R - FORT_BASE_H;
-	calcNormalCylinderSide();
-	calcNormalFort();
-	calcNormalIsland();
-	calcSea();
+// batched heights for n entities starting at firstEntity
+void seaHeightEntities(int firstEntity, const vec3f *p, int n, float *y) {
+	seaGridUpdate();
+	for (int k = 0; k < n; k++)
+		y[k] = seaHeightEntity(firstEntity + k, p[k].x, p[k].z);
 }
 
 void drawNormalCylinder(float r, float h) {
@@ -448,23 +2917,34 @@ void drawNormalCylinder(float r, float h) {
 }
 
 void drawNormalIsland() {
-	glTranslatef(-5.0, -1.0, -5.0);
+	glTranslatef(-terrain.worldSize / 2.0, -1.0, -terrain.worldSize / 2.0);
 	glBegin(GL_LINES);
 	glColor3f(1.0, 1.0, 0.0);
 	for (int j = 0; j < global.tessellation + 1; j++) {
 		for (int i = 0; i < global.tessellation + 1; i++) {
-			float y = height[(j * global.next + MAX_TESSELLATION / MIN_TESSELLATION) * LENGTH_HEIGHT + i * global.next + MAX_TESSELLATION / MIN_TESSELLATION];
+			float y = terrainAt(i * global.next, j * global.next);
 			// draw y vector
 			glVertex3f(i * global.step, y, j * global.step);
 			glVertex3f(i * global.step + islandNormals[j * 3 * (global.tessellation + 1) + i * 3], y + islandNormals[j * 3 * (global.tessellation + 1) + i * 3 + 1], j * global.step + islandNormals[j * 3 * (global.tessellation + 1) + i * 3 + 2]);
 		}
 	}
 	glEnd();
-	glTranslatef(5.0, 1.0, 5.0);
+	glTranslatef(terrain.worldSize / 2.0, 1.0, terrain.worldSize / 2.0);
+}
+
+// float every boat on the sea with one batched height query
+void floatBoats() {
+	vec3f p[MAX_BOAT_NUM];
+	float y[MAX_BOAT_NUM];
+	for (int i = 0; i < MAX_BOAT_NUM; i++)
+		p[i] = boat[i].p;
+	seaHeightEntities(0, p, MAX_BOAT_NUM, y);
+	for (int i = 0; i < MAX_BOAT_NUM; i++)
+		boat[i].p.y = y[i];
 }
 
 void initialBoats() {
-	srand((unsigned)time(0));
+	srand(randomSeed ? randomSeed : (unsigned)time(0));
 	for (int i = 0; i < MAX_BOAT_NUM; i++) {
 		float random = float(rand() % 30) / 15.0 * M_PI;
 		for (int j = 0; j < i + 1; j++) {
@@ -477,8 +2957,6 @@ void initialBoats() {
 
 		boat[i].p.x = -BOAT_R0 * sinf(boat[i].angle);
 		boat[i].p.z = -BOAT_R0 * cosf(boat[i].angle);
-		float temp;
-		calcSineWave(sw1, sw2, sw3, sw4, boat[i].p.x, boat[i].p.z, global.t, &boat[i].p.y, false, &temp, &temp, &temp);
 		boat[i].cannonAngle = INITIAL_BOAT_CANNON_ANGLE;
 		random = 0.5 + float(rand() % 5) / 10.0;
 		boat[i].v.x = MAX_BOAT_V * random * sinf(boat[i].angle);
@@ -492,11 +2970,11 @@ void initialBoats() {
 		boat[i].isHit = false;
 		boat[i].initial = true;
 	}
+	floatBoats();
 }
 
 void initialBall(int i) {
-	float temp;
-	calcSineWave(sw1, sw2, sw3, sw4, boat[i].p.x, boat[i].p.z, global.t, &boat[i].p.y, false, &temp, &temp, &temp);
+	boat[i].p.y = seaHeightEntity(i, boat[i].p.x, boat[i].p.z);
 	ball[i].pv.p = { BOAT_BALL_X, BOAT_BALL_Y, BOAT_BALL_Z };
 	ball[i].pv.v = { BOAT_BALL_VX, BOAT_BALL_VY, BOAT_BALL_VZ };
 	ball[i].fire = true;
@@ -580,75 +3058,1134 @@ void drawNormalParticles(int i) {
 	}
 }
 
+// normals of the sea grid, which unlike the wave model belongs to the thread that draws
 void drawNormalSineWave() {
 	glBegin(GL_LINES);
 	glColor3f(1.0, 1.0, 0.0);
-	float xStep = RANGE_SEA / global.tessellation / 10.0;
-	float zStep = RANGE_SEA / global.tessellation / 10.0;
-	float x, y, z, dydx, dydz, dy;
-	for (int j = 0; j <= global.tessellation * 10; j++) {
-		z = -RANGE_SEA / 2.0 + j * zStep;
-		for (int i = 0; i < global.tessellation * 10 + 1; i++) {
-			x = -RANGE_SEA / 2.0 + i * xStep;
-			calcSineWave(sw1, sw2, sw3, sw4, x, z, global.t, &y, true, &dydx, &dydz, &dy);
-			glVertex3f(x, y, z);
-			glVertex3f(x + dydx * RATIO, y + dy * RATIO, z + dydz * RATIO);
-		}
+	int count = (seaHeight.gridTess + 1) * (seaHeight.gridTess + 1);
+	for (int k = 0; k < count; k++) {
+		const GLfloat *v = seaVertices + k * 3, *n = seaNormals + k * 3;
+		glVertex3f(v[0], v[1], v[2]);
+		glVertex3f(v[0] + n[0] * RATIO, v[1] + n[1] * RATIO, v[2] + n[2] * RATIO);
 	}
 	glEnd();
 }
 
-void renderIsland() {
+/************************************************************************************************
+ * Shaders
+ *
+ * The few shaders the game uses are GLSL 1.20 and read the fixed function state, so they
+ * follow glLightfv() and glMaterialfv() like everything else. light0() is shared by all of
+ * them; it is the fixed function lighting of the directional GL_LIGHT0 for an eye space normal.
+ *************************************************************************************************/
+static const char *light0Glsl =
+	"vec4 light0(vec3 n) {\n"
+	"	vec3 l = normalize(gl_LightSource[0].position.xyz);\n"
+	"	float d = max(dot(n, l), 0.0);\n"
+	"	vec4 c = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient + gl_FrontLightProduct[0].diffuse * d;\n"
+	"	if (d > 0.0)\n"
+	"		c += gl_FrontLightProduct[0].specular * pow(max(dot(n, normalize(gl_LightSource[0].halfVector.xyz)), 0.0), gl_FrontMaterial.shininess);\n"
+	"	return vec4(c.rgb, gl_FrontMaterial.diffuse.a);\n"
+	"}\n";
+
+GLuint compileShader(GLenum type, const char *source) {
+	const char *sources[] = { "#version 120\n", light0Glsl, source };
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 3, sources, NULL);
+	glCompileShader(shader);
+	GLint ok;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if (!ok) {
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof log, NULL, log);
+		printf("Shader compile failed: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+// link a program from vertex and fragment source; 0 on failure
+GLuint buildProgram(const char *vertexSource, const char *fragmentSource) {
+	const char *version = (const char *)glGetString(GL_VERSION);
+	if (!version || atoi(version) < 2)
+		return 0;
+	GLuint vs = compileShader(GL_VERTEX_SHADER, vertexSource);
+	GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+	if (!vs || !fs)
+		return 0;
+	GLuint program = glCreateProgram();
+	glAttachShader(program, vs);
+	glAttachShader(program, fs);
+	glLinkProgram(program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+	GLint ok;
+	glGetProgramiv(program, GL_LINK_STATUS, &ok);
+	if (!ok) {
+		char log[1024];
+		glGetProgramInfoLog(program, sizeof log, NULL, log);
+		printf("Shader link failed: %s\n", log);
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+/************************************************************************************************
+ * Index layouts
+ *
+ * Every vertex the post transform cache misses is lit and transformed again, so the order of a
+ * grid's triangles decides how often each vertex is processed. gridIndices() emits the quads of
+ * a w x h vertex grid, each split along the same diagonal as GL_QUADS would, in one of these
+ * layouts:
+ *   - rows: a triangle list in row order, which misses every vertex of a row twice,
+ *   - strips: one triangle strip per column of quads, ended by the primitive restart index,
+ *   - stripes: a triangle list in bands of INDEX_STRIPE rows walked column by column, so the
+ *     vertices a column shares with the next are still cached when it is drawn,
+ *   - stripe-strips: the bands drawn as strips.
+ * The average cache miss ratio (ACMR), misses per triangle, approaches 0.5 for a large grid in
+ * the best order and is about 1 in row order. --bench-indices prints it for each layout on the grids the
+ * game draws, simulating FIFO caches of a few sizes, and --index-layout picks the layout the
+ * island and terrain patches are drawn with. Strips need primitive restart from OpenGL 3.1;
+ * without it they are drawn as the list of the same order.
+ *************************************************************************************************/
+#define INDEX_CACHE 16 // vertices the layouts are tuned for
+#define INDEX_STRIPE (INDEX_CACHE - 2) // quad rows per band of strips; a column of a band fits the cache
+#define INDEX_RESTART 0xFFFFFFFFu
+
+enum { INDEX_ROWS, INDEX_STRIPS, INDEX_STRIPES, INDEX_STRIPE_STRIPS, INDEX_LAYOUT_NUM };
+
+static const char *indexLayoutNames[INDEX_LAYOUT_NUM] = { "rows", "strips", "stripes", "stripe-strips" };
+
+typedef struct {
+	int layout; // --index-layout
+	bool restart; // primitive restart is available
+} indexLayout_t;
+
+indexLayout_t indexLayout = { INDEX_STRIPE_STRIPS, false };
+
+bool indexStrips(int layout) {
+	return layout == INDEX_STRIPS || layout == INDEX_STRIPE_STRIPS;
+}
+
+// indices of the quads of a w x h vertex grid in a layout, at most capacity of them; returns
+// how many were written, 0 if they do not fit
+int gridIndices(int w, int h, int layout, GLuint *indices, int capacity) {
+	int k = 0;
+	// every index is counted, but only those that fit are written
+	auto put = [&](GLuint v) {
+		if (k < capacity)
+			indices[k] = v;
+		k++;
+	};
+	if (layout == INDEX_ROWS) {
+		for (int j = 0; j < h - 1; j++) {
+			for (int i = 0; i < w - 1; i++) {
+				GLuint v00 = j * w + i, v10 = v00 + 1, v01 = v00 + w, v11 = v01 + 1;
+				put(v00); put(v01); put(v11);
+				put(v00); put(v11); put(v10);
+			}
+		}
+	} else {
+		// a list uses a vertex once more after the next one enters the cache, so its bands are narrower
+		int band = layout == INDEX_STRIPS ? h - 1 : layout == INDEX_STRIPES ? INDEX_STRIPE - 1 : INDEX_STRIPE;
+		for (int j0 = 0; j0 < h - 1; j0 += band) {
+			int j1 = j0 + band < h - 1 ? j0 + band : h - 1;
+			if (layout != INDEX_STRIPS) {
+				// degenerate triangles load the first column of a band in order; otherwise its
+				// vertices are interleaved with the second column's and both are evicted early
+				for (int j = j0; j < j1; j++) {
+					put(j * w);
+					put(j * w);
+					put((j + 1) * w);
+				}
+				if (indexStrips(layout))
+					put(INDEX_RESTART);
+			}
+			for (int i = 0; i < w - 1; i++) {
+				if (indexStrips(layout)) {
+					// pairs of i + 1 and i down the column keep the winding and diagonal of the list
+					for (int j = j0; j <= j1; j++) {
+						put(j * w + i + 1);
+						put(j * w + i);
+					}
+					put(INDEX_RESTART);
+					continue;
+				}
+				// the triangles of the strip, so vertices enter the cache in the same order
+				for (int j = j0; j < j1; j++) {
+					GLuint v00 = j * w + i, v10 = v00 + 1, v01 = v00 + w, v11 = v01 + 1;
+					put(v10); put(v00); put(v11);
+					put(v11); put(v00); put(v01);
+				}
+			}
+		}
+	}
+	if (k > capacity) {
+		printf("A %d x %d grid needs %d indices in the %s layout, more than the %d there is room for.\n",
+			w, h, k, indexLayoutNames[layout], capacity);
+		return 0;
+	}
+	return k;
+}
+
+// the layout to draw with, falling back to the list of the same order without primitive restart
+int gridLayout() {
+	if (indexStrips(indexLayout.layout) && !indexLayout.restart)
+		return indexLayout.layout == INDEX_STRIPS ? INDEX_ROWS : INDEX_STRIPES;
+	return indexLayout.layout;
+}
+
+GLenum gridMode(int layout) {
+	return indexStrips(layout) ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+}
+
+// turn primitive restart on or off around drawing a layout; restart is the index type's maximum
+void gridRestart(int layout, GLuint restart, bool on) {
+#ifdef GL_PRIMITIVE_RESTART
+	if (!indexStrips(layout))
+		return;
+	if (on) {
+		glEnable(GL_PRIMITIVE_RESTART);
+		glPrimitiveRestartIndex(restart);
+	} else {
+		glDisable(GL_PRIMITIVE_RESTART);
+	}
+#endif
+}
+
+// primitive restart needs OpenGL 3.1
+void gridRestartInit() {
+#ifdef GL_PRIMITIVE_RESTART
+	const char *version = (const char *)glGetString(GL_VERSION);
+	int major = 0, minor = 0;
+	if (version)
+		sscanf(version, "%d.%d", &major, &minor);
+	indexLayout.restart = major > 3 || (major == 3 && minor >= 1);
+#endif
+	if (indexStrips(indexLayout.layout) && !indexLayout.restart)
+		printf("Triangle strips need primitive restart from OpenGL 3.1; using triangle lists.\n");
+}
+
+// average cache misses per triangle of drawing indices through a FIFO cache of cacheSize vertices
+float gridAcmr(const GLuint *indices, int count, bool strips, int cacheSize) {
+	GLuint cache[64];
+	int head = 0, used = 0, misses = 0, triangles = 0, run = 0;
+	for (int k = 0; k < count; k++) {
+		if (strips && indices[k] == INDEX_RESTART) {
+			run = 0;
+			continue;
+		}
+		bool hit = false;
+		for (int c = 0; c < used && !hit; c++)
+			hit = cache[c] == indices[k];
+		if (!hit) {
+			cache[head] = indices[k];
+			head = (head + 1) % cacheSize;
+			used = used < cacheSize ? used + 1 : used;
+			misses++;
+		}
+		// degenerate triangles are not counted
+		if (!(strips ? ++run >= 3 : k % 3 == 2))
+			continue;
+		const GLuint *t = &indices[k - 2];
+		if (t[0] != t[1] && t[1] != t[2] && t[0] != t[2])
+			triangles++;
+	}
+	return triangles ? float(misses) / triangles : 0.0f;
+}
+
+/************************************************************************************************
+ * Compact vertex format
+ *
+ * The sea and the island are height grids, so x and z follow from the grid index and only the
+ * height and the normal change. In compact mode a grid is drawn from
+ *   - a static buffer of (i, j) grid indices as two unsigned shorts, uploaded once per size,
+ *   - a static index buffer, uploaded once per size,
+ *   - a data buffer of 4 bytes per vertex: a 16 bit height quantised over the grid's own
+ *     height range and the normal as an octahedral 2 x 8 bit pair.
+ * A vertex shader decodes position and normal and lights the vertex with light0(), so both
+ * paths look the same.
+ * Only the data buffer is uploaded again, and only when the heights changed: 4 bytes per sea
+ * vertex instead of 24 bytes of float position and normal plus the client side indices.
+ *************************************************************************************************/
+typedef struct {
+	GLuint gridVbo, dataVbo, indexVbo;
+	int w, h; // grid size the buffers were built for
+	int indexCount;
+	int dataVersion; // version of the heights in dataVbo
+	float heightScale, heightOffset; // y = height * heightScale + heightOffset
+} compactMesh_t;
+
+typedef struct {
+	bool enabled; // draw the sea and island from compact vertices
+	GLuint program; // 0 when shaders are not available
+	GLint aGrid, aHeight, aNormal;
+	GLint uGrid, uHeight, uNormalScale, uTexScale, uTextured;
+	compactMesh_t sea, island;
+	int islandVersion; // bumped by buildIsland()
+	long frameUploadBytes; // vertex and index bytes handed to GL for the sea and island this frame
+} compact_t;
+
+compact_t compact = { false, 0 };
+
+static const char *compactVertexShader =
+	"attribute vec2 a_grid;\n"
+	"attribute float a_height;\n"
+	"attribute vec2 a_normal;\n"
+	"uniform vec4 u_grid;\n" // x0, z0, dx, dz
+	"uniform vec2 u_height;\n" // scale, offset
+	"uniform float u_normalScale;\n"
+	"uniform vec2 u_texScale;\n"
+	"varying vec4 v_color;\n"
+	"varying vec2 v_tex;\n"
+	"void main() {\n"
+	"	vec3 n = vec3(a_normal.x, 1.0 - abs(a_normal.x) - abs(a_normal.y), a_normal.y);\n"
+	"	if (n.y < 0.0)\n"
+	"		n.xz = (1.0 - abs(n.zx)) * sign(n.xz);\n"
+	"	v_color = light0(gl_NormalMatrix * normalize(n) * u_normalScale);\n"
+	"	v_tex = a_grid * u_texScale;\n"
+	"	gl_Position = gl_ModelViewProjectionMatrix * vec4(u_grid.x + a_grid.x * u_grid.z, a_height * u_height.x + u_height.y, u_grid.y + a_grid.y * u_grid.w, 1.0);\n"
+	"}\n";
+
+static const char *compactFragmentShader =
+	"uniform sampler2D u_tex;\n"
+	"uniform bool u_textured;\n"
+	"varying vec4 v_color;\n"
+	"varying vec2 v_tex;\n"
+	"void main() {\n"
+	"	gl_FragColor = u_textured ? v_color * texture2D(u_tex, v_tex) : v_color;\n"
+	"}\n";
+
+bool compactInit() {
+	compact.program = buildProgram(compactVertexShader, compactFragmentShader);
+	if (!compact.program) {
+		printf("Compact vertex format needs OpenGL 2.0 shaders; using float vertices.\n");
+		compact.enabled = false;
+		return false;
+	}
+	compact.aGrid = glGetAttribLocation(compact.program, "a_grid");
+	compact.aHeight = glGetAttribLocation(compact.program, "a_height");
+	compact.aNormal = glGetAttribLocation(compact.program, "a_normal");
+	compact.uGrid = glGetUniformLocation(compact.program, "u_grid");
+	compact.uHeight = glGetUniformLocation(compact.program, "u_height");
+	compact.uNormalScale = glGetUniformLocation(compact.program, "u_normalScale");
+	compact.uTexScale = glGetUniformLocation(compact.program, "u_texScale");
+	compact.uTextured = glGetUniformLocation(compact.program, "u_textured");
+	glUseProgram(compact.program);
+	glUniform1i(glGetUniformLocation(compact.program, "u_tex"), 0);
+	glUseProgram(0);
+	return true;
+}
+
+// octahedral encoding of a normal with y up into two signed bytes
+void octEncode(float x, float y, float z, GLbyte *e) {
+	float s = fabsf(x) + fabsf(y) + fabsf(z);
+	float u = x / s, v = z / s;
+	if (y < 0.0f) {
+		float fu = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		float fv = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+		u = fu;
+		v = fv;
+	}
+	e[0] = (GLbyte)lrintf(u * 127.0f);
+	e[1] = (GLbyte)lrintf(v * 127.0f);
+}
+
+// grid index and index buffers for a w x h vertex grid; uploaded only when the size changes
+void compactMeshGrid(compactMesh_t *m, int w, int h, const GLuint *indices, int indexCount) {
+	if (m->w == w && m->h == h && m->indexCount == indexCount)
+		return;
+	if (!m->gridVbo) {
+		glGenBuffers(1, &m->gridVbo);
+		glGenBuffers(1, &m->dataVbo);
+		glGenBuffers(1, &m->indexVbo);
+	}
+	GLushort *grid = (GLushort *)malloc(w * h * 2 * sizeof(GLushort));
+	for (int j = 0; j < h; j++) {
+		for (int i = 0; i < w; i++) {
+			grid[(j * w + i) * 2] = i;
+			grid[(j * w + i) * 2 + 1] = j;
+		}
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, m->gridVbo);
+	glBufferData(GL_ARRAY_BUFFER, w * h * 2 * sizeof(GLushort), grid, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->indexVbo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(grid);
+	compact.frameUploadBytes += w * h * 2 * sizeof(GLushort) + indexCount * sizeof(GLuint);
+	m->w = w;
+	m->h = h;
+	m->indexCount = indexCount;
+	m->dataVersion = -1;
+}
+
+// quantise heights and normals of float xyz arrays into the data buffer when version changed
+void compactMeshData(compactMesh_t *m, int version, const GLfloat *vertices, const GLfloat *normals) {
+	if (m->dataVersion == version)
+		return;
+	int count = m->w * m->h;
+	float lo = vertices[1], hi = vertices[1];
+	for (int k = 1; k < count; k++) {
+		lo = fminf(lo, vertices[k * 3 + 1]);
+		hi = fmaxf(hi, vertices[k * 3 + 1]);
+	}
+	m->heightOffset = (hi + lo) / 2.0f;
+	m->heightScale = hi > lo ? (hi - lo) / 2.0f : 1.0f;
+	GLshort *data = (GLshort *)malloc(count * 2 * sizeof(GLshort));
+	for (int k = 0; k < count; k++) {
+		data[k * 2] = (GLshort)lrintf((vertices[k * 3 + 1] - m->heightOffset) / m->heightScale * 32767.0f);
+		octEncode(normals[k * 3], normals[k * 3 + 1], normals[k * 3 + 2], (GLbyte *)&data[k * 2 + 1]);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, m->dataVbo);
+	glBufferData(GL_ARRAY_BUFFER, count * 2 * sizeof(GLshort), data, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	free(data);
+	compact.frameUploadBytes += count * 2 * sizeof(GLshort);
+	m->dataVersion = version;
+}
+
+// draw a compact grid whose vertex (i, j) sits at (x0 + i * dx, z0 + j * dz)
+void compactMeshDraw(compactMesh_t *m, GLenum mode, float x0, float z0, float dx, float dz, float normalScale, bool textured, float texScale) {
+	glUseProgram(compact.program);
+	glUniform4f(compact.uGrid, x0, z0, dx, dz);
+	glUniform2f(compact.uHeight, m->heightScale / 32767.0f, m->heightOffset);
+	glUniform1f(compact.uNormalScale, normalScale);
+	glUniform2f(compact.uTexScale, texScale, texScale);
+	glUniform1i(compact.uTextured, textured);
+
+	glEnableVertexAttribArray(compact.aGrid);
+	glEnableVertexAttribArray(compact.aHeight);
+	glEnableVertexAttribArray(compact.aNormal);
+	glBindBuffer(GL_ARRAY_BUFFER, m->gridVbo);
+	glVertexAttribPointer(compact.aGrid, 2, GL_UNSIGNED_SHORT, GL_FALSE, 0, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, m->dataVbo);
+	glVertexAttribPointer(compact.aHeight, 1, GL_SHORT, GL_FALSE, 2 * sizeof(GLshort), 0);
+	glVertexAttribPointer(compact.aNormal, 2, GL_BYTE, GL_TRUE, 2 * sizeof(GLshort), (const GLvoid *)sizeof(GLshort));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->indexVbo);
+	glDrawElements(mode, m->indexCount, GL_UNSIGNED_INT, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glDisableVertexAttribArray(compact.aGrid);
+	glDisableVertexAttribArray(compact.aHeight);
+	glDisableVertexAttribArray(compact.aNormal);
+	glUseProgram(0);
+}
+
+static const char *seaNormalMapVertexShader =
+	"uniform float u_period;\n"
+	"varying vec2 v_tex;\n"
+	"void main() {\n"
+	"	v_tex = gl_Vertex.xz / u_period;\n"
+	"	gl_Position = ftransform();\n"
+	"}\n";
+
+static const char *seaNormalMapFragmentShader =
+	"uniform sampler2D u_normalMap;\n"
+	"varying vec2 v_tex;\n"
+	"void main() {\n"
+	"	gl_FragColor = light0(normalize(gl_NormalMatrix * (texture2D(u_normalMap, v_tex).xyz * 2.0 - 1.0)));\n"
+	"}\n";
+
+bool seaNormalMapInit() {
+	if (!seaNormalMap.program)
+		seaNormalMap.program = buildProgram(seaNormalMapVertexShader, seaNormalMapFragmentShader);
+	if (!seaNormalMap.program) {
+		printf("Normal mapped sea needs OpenGL 2.0 shaders; using vertex normals.\n");
+		seaNormalMap.enabled = false;
+		return false;
+	}
+	seaNormalMap.uPeriod = glGetUniformLocation(seaNormalMap.program, "u_period");
+	glUseProgram(seaNormalMap.program);
+	glUniform1i(glGetUniformLocation(seaNormalMap.program, "u_normalMap"), 0);
+	glUseProgram(0);
+	if (!seaNormalMap.texture) {
+		glGenTextures(1, &seaNormalMap.texture);
+		seaNormalMap.texels = (GLubyte *)malloc(seaNormalMap.size * seaNormalMap.size * 3);
+		glBindTexture(GL_TEXTURE_2D, seaNormalMap.texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, seaNormalMap.size, seaNormalMap.size, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	seaNormalMap.version = seaNormalMap.texelVersion = -1;
+	return true;
+}
+
+// the normals of one period of the surface from the wave model as size x size RGB texels
+void seaNormalMapTexels(GLubyte *texels) {
+	int size = seaNormalMap.size;
+	float step = waveModel->period() / size;
+	float t = global.t;
+	jobFor("sea normal map", size, 16, [=](int j0, int j1) {
+		for (int j = j0; j < j1; j++) {
+			for (int i = 0; i < size; i++) {
+				float y, dydx, dydz, dy;
+				calcSeaWave((i + 0.5f) * step, (j + 0.5f) * step, t, &y, true, &dydx, &dydz, &dy);
+				GLubyte *texel = texels + (j * size + i) * 3;
+				texel[0] = (GLubyte)lrintf((dydx * 0.5f + 0.5f) * 255.0f);
+				texel[1] = (GLubyte)lrintf((dy * 0.5f + 0.5f) * 255.0f);
+				texel[2] = (GLubyte)lrintf((dydz * 0.5f + 0.5f) * 255.0f);
+			}
+		}
+	});
+}
+
+const GLubyte *simTexels();
+
+// regenerate the texels for the current sea grid, unless the simulation thread did
+void seaNormalMapGenerate() {
+	if (!seaNormalMap.enabled || seaNormalMap.texelVersion == seaHeight.tick || simTexels())
+		return;
+	seaNormalMapTexels(seaNormalMap.texels);
+	seaNormalMap.texelVersion = seaHeight.tick;
+}
+
+// upload the normal texture for the current sea grid
+void seaNormalMapUpdate() {
+	if (seaNormalMap.version == seaHeight.tick)
+		return;
+	int size = seaNormalMap.size;
+	// the simulation thread generates the texels along with the sea grid it publishes
+	const GLubyte *texels = simTexels();
+	if (!texels) {
+		seaNormalMapGenerate();
+		texels = seaNormalMap.texels;
+	}
+	glBindTexture(GL_TEXTURE_2D, seaNormalMap.texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RGB, GL_UNSIGNED_BYTE, texels);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	compact.frameUploadBytes += size * size * 3;
+	seaNormalMap.version = seaHeight.tick;
+}
+
+void renderSeaNormalMapped() {
+	int tess = seaGridTess();
+	seaNormalMapUpdate();
+	compact.frameUploadBytes += (tess + 1) * (tess + 1) * 3 * sizeof(GLfloat) + tess * tess * 6 * sizeof(GLuint);
+
+	glUseProgram(seaNormalMap.program);
+	glUniform1f(seaNormalMap.uPeriod, waveModel->period());
+	glBindTexture(GL_TEXTURE_2D, seaNormalMap.texture);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, seaVertices);
+	glDrawElements(GL_TRIANGLES, tess * tess * 6, GL_UNSIGNED_INT, seaIndices);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glUseProgram(0);
+}
+
+// switch normal mapped sea on or off; the sea grid changes resolution with it
+void seaNormalMapEnable(bool enable) {
+	if (enable && waveModel->period() <= 0.0f) {
+		printf("The %s wave model does not tile; normal mapped sea is not available.\n", waveModel->name);
+		enable = false;
+	}
+	if (enable && !seaNormalMapInit())
+		enable = false;
+	seaNormalMap.enabled = enable;
+	global.dirty |= DIRTY_TESSELLATION;
+}
+
+/************************************************************************************************
+ * Terrain level of detail
+ *
+ * Large heightmaps are drawn as a quadtree of patches instead of one grid. Every patch is a grid
+ * of TERRAIN_PATCH quads, so a node at level l samples the terrain every 2^(depth - l) samples
+ * and all patches share one index buffer. The tree covers the smallest power of two multiple of
+ * TERRAIN_PATCH samples that holds the terrain; vertices past its edge are clamped onto it.
+ *
+ * Every node knows the largest height error of drawing it in place of the full terrain. Each
+ * frame the tree is refined from the root by splitting the visible node with the largest error
+ * in pixels until none is over the threshold or the patch budget is spent, which bounds the
+ * triangle count whatever the heightmap size. The threshold grows as global.tessellation drops.
+ * Neighbouring patches at different levels leave cracks of at most twice the root error, so every
+ * patch has a skirt that deep hanging from its border to hide them.
+ *
+ * Patch vertices are built the first time a node is drawn and kept in up to cacheSize VBOs,
+ * reusing the least recently drawn one when they run out. They come from the node's page, which
+ * for paged terrain may still be loading; such a node is not split until the pages of all its
+ * children are in, so the view sharpens as they arrive.
+ *
+ * With OpenGL 2.0 the patches of a resident terrain are lit per pixel from a mipmapped normal map
+ * of the whole terrain, so coarse patches keep the shading of the full resolution surface.
+ * Without it, and for paged or quantised terrain, they are lit by their vertex normals.
+ *************************************************************************************************/
+#define TERRAIN_PATCH_VERTICES (TERRAIN_PATCH + 3) // per side, including the skirt ring
+
+typedef struct {
+	GLuint vbo;
+	int node; // -1 when free
+	int lastUsed; // frame the patch was last drawn in
+} terrainPatch_t;
+
+typedef struct {
+	bool enabled;
+	float tau; // screen space error threshold in pixels at MAX_TESSELLATION
+	int maxPatches; // patches drawn per frame at most
+	int cacheSize; // patches kept in VBOs
+	int depth; // level of the leaves, which sample every terrain sample
+	int nodes;
+	float *error; // per node, nodes stored level by level in row order
+	float *minY, *maxY;
+	float skirt;
+	int *patchOf; // cache slot of each node, -1 when not cached
+	terrainPatch_t *patches;
+	GLuint indexVbo;
+	int indexCount, layout;
+	GLuint program, normalMap; // per pixel lighting, 0 when not available
+	GLint uNormalScale, uTextured;
+	int frame;
+	int drawn; // patches drawn in the last frame
+} terrainLod_t;
+
+terrainLod_t terrainLod = { false, 2.0f, 128, 256 };
+
+// terrain sample of a patch vertex, clamped to the terrain edge
+int terrainLodSample(int i) {
+	return i < terrain.size - 1 ? i : terrain.size - 1;
+}
+
+// height error, in the node at level and x, z, of the vertices its children add
+float terrainLodDeviation(int level, int x, int z) {
+	int step = 1 << (terrainLod.depth - level), half = step / 2;
+	int x0 = x * step * TERRAIN_PATCH, z0 = z * step * TERRAIN_PATCH;
+	if (x0 >= terrain.size - 1 || z0 >= terrain.size - 1)
+		return 0.0f;
+	float error = 0.0f;
+	for (int b = 0; b <= 2 * TERRAIN_PATCH; b++) {
+		int j = z0 + b * half;
+		for (int a = b & 1 ? 0 : 1; a <= 2 * TERRAIN_PATCH; a += b & 1 ? 1 : 2) {
+			int i = x0 + a * half;
+			// the parent has this vertex on an edge or on the diagonal of a quad
+			int di = a & 1 ? half : 0, dj = b & 1 ? half : 0;
+			float coarse = (terrainAt(terrainLodSample(i - di), terrainLodSample(j - dj)) + terrainAt(terrainLodSample(i + di), terrainLodSample(j + dj))) / 2.0f;
+			float d = fabsf(terrainAt(terrainLodSample(i), terrainLodSample(j)) - coarse);
+			if (d > error)
+				error = d;
+		}
+	}
+	return error;
+}
+
+static const char *terrainLodVertexShader =
+	"uniform vec2 u_normalScale;\n" // island coordinates to normal map texels: 1 / (spacing * size), 0.5 / size
+	"varying vec2 v_tex;\n"
+	"varying vec2 v_normalTex;\n"
+	"void main() {\n"
+	"	v_tex = gl_MultiTexCoord0.xy;\n"
+	"	v_normalTex = gl_Vertex.xz * u_normalScale.x + u_normalScale.y;\n"
+	"	gl_Position = ftransform();\n"
+	"}\n";
+
+static const char *terrainLodFragmentShader =
+	"uniform sampler2D u_tex;\n"
+	"uniform sampler2D u_normalMap;\n"
+	"uniform bool u_textured;\n"
+	"varying vec2 v_tex;\n"
+	"varying vec2 v_normalTex;\n"
+	"void main() {\n"
+	"	vec4 c = light0(normalize(gl_NormalMatrix * (texture2D(u_normalMap, v_normalTex).xyz * 2.0 - 1.0)));\n"
+	"	gl_FragColor = u_textured ? c * texture2D(u_tex, v_tex) : c;\n"
+	"}\n";
+
+// generate the terrain normal map; patches fall back to vertex normals without it
+bool terrainLodNormalMapInit() {
+	if (!terrainLod.program)
+		terrainLod.program = buildProgram(terrainLodVertexShader, terrainLodFragmentShader);
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	if (!terrainLod.program || terrain.size > maxSize) {
+		printf("Terrain normal map needs OpenGL 2.0 shaders and %d x %d textures; using vertex normals.\n", terrain.size, terrain.size);
+		return false;
+	}
+	terrainLod.uNormalScale = glGetUniformLocation(terrainLod.program, "u_normalScale");
+	terrainLod.uTextured = glGetUniformLocation(terrainLod.program, "u_textured");
+	glUseProgram(terrainLod.program);
+	glUniform1i(glGetUniformLocation(terrainLod.program, "u_tex"), 0);
+	glUniform1i(glGetUniformLocation(terrainLod.program, "u_normalMap"), 1);
+	glUseProgram(0);
+
+	GLubyte *normals = (GLubyte *)malloc((size_t)terrain.size * terrain.size * 3);
+	if (!normals) {
+		printf("Not enough memory for the terrain normal map; using vertex normals.\n");
+		return false;
+	}
+	terrainNormals(normals);
+	if (!terrainLod.normalMap)
+		glGenTextures(1, &terrainLod.normalMap);
+	glBindTexture(GL_TEXTURE_2D, terrainLod.normalMap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, terrain.size, terrain.size, 0, GL_RGB, GL_UNSIGNED_BYTE, normals);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	free(normals);
+	return true;
+}
+
+// build the node error and height bounds bottom up from the resident terrain, or take them from
+// the page file
+bool terrainLodTree() {
+	free(terrainLod.error);
+	free(terrainLod.minY);
+	free(terrainLod.maxY);
+	free(terrainLod.patchOf);
+	terrainLod.depth = 0;
+	while ((TERRAIN_PATCH << terrainLod.depth) < terrain.size - 1)
+		terrainLod.depth++;
+	terrainLod.nodes = terrainLodNode(terrainLod.depth + 1, 0, 0);
+	terrainLod.error = (float *)malloc(terrainLod.nodes * sizeof(float));
+	terrainLod.minY = (float *)malloc(terrainLod.nodes * sizeof(float));
+	terrainLod.maxY = (float *)malloc(terrainLod.nodes * sizeof(float));
+	terrainLod.patchOf = (int *)malloc(terrainLod.nodes * sizeof(int));
+	if (!terrainLod.error || !terrainLod.minY || !terrainLod.maxY || !terrainLod.patchOf) {
+		printf("Not enough memory for terrain level of detail.\n");
+		return false;
+	}
+	if (!terrainResident()) {
+		memcpy(terrainLod.error, terrainPager.error, terrainLod.nodes * sizeof(float));
+		memcpy(terrainLod.minY, terrainPager.minY, terrainLod.nodes * sizeof(float));
+		memcpy(terrainLod.maxY, terrainPager.maxY, terrainLod.nodes * sizeof(float));
+		return true;
+	}
+	for (int level = terrainLod.depth; level >= 0; level--) {
+		for (int z = 0; z < 1 << level; z++) {
+			for (int x = 0; x < 1 << level; x++) {
+				int n = terrainLodNode(level, x, z);
+				if (level == terrainLod.depth) {
+					// samples past the terrain edge repeat it, so they are left out
+					float lo = 1e30f, hi = -1e30f;
+					int i0 = terrainLodSample(x * TERRAIN_PATCH), i1 = terrainLodSample((x + 1) * TERRAIN_PATCH);
+					int j0 = terrainLodSample(z * TERRAIN_PATCH), j1 = terrainLodSample((z + 1) * TERRAIN_PATCH);
+					GLfloat scratch[TERRAIN_PAGE];
+					for (int j = j0; j <= j1; j++) {
+						const GLfloat *row = terrainSamples(j, i0, i1 - i0 + 1, scratch);
+						for (int i = 0; i <= i1 - i0; i++) {
+							lo = row[i] < lo ? row[i] : lo;
+							hi = row[i] > hi ? row[i] : hi;
+						}
+					}
+					terrainLod.error[n] = 0.0f;
+					terrainLod.minY[n] = lo;
+					terrainLod.maxY[n] = hi;
+					continue;
+				}
+				float error = 0.0f, lo = 1e30f, hi = -1e30f;
+				for (int c = 0; c < 4; c++) {
+					int child = terrainLodNode(level + 1, 2 * x + (c & 1), 2 * z + (c >> 1));
+					error = terrainLod.error[child] > error ? terrainLod.error[child] : error;
+					lo = terrainLod.minY[child] < lo ? terrainLod.minY[child] : lo;
+					hi = terrainLod.maxY[child] > hi ? terrainLod.maxY[child] : hi;
+				}
+				terrainLod.error[n] = error + terrainLodDeviation(level, x, z);
+				terrainLod.minY[n] = lo;
+				terrainLod.maxY[n] = hi;
+			}
+		}
+	}
+	return true;
+}
+
+// set up the tree, the patch cache and the normal map; needs a GL context
+bool terrainLodInit() {
+	if (!terrainLodTree())
+		return false;
+	terrainLod.skirt = 2.0f * terrainLod.error[0];
+	for (int n = 0; n < terrainLod.nodes; n++)
+		terrainLod.patchOf[n] = -1;
+
+	if (!terrainLod.patches) {
+		if (terrainLod.cacheSize < terrainLod.maxPatches)
+			terrainLod.cacheSize = terrainLod.maxPatches;
+		// one index buffer for the patch grid and its skirt ring
+		static GLuint grid[GRID_INDICES_MAX(TERRAIN_PATCH_VERTICES, TERRAIN_PATCH_VERTICES)];
+		static GLushort indices[GRID_INDICES_MAX(TERRAIN_PATCH_VERTICES, TERRAIN_PATCH_VERTICES)];
+		terrainLod.layout = gridLayout();
+		terrainLod.indexCount = gridIndices(TERRAIN_PATCH_VERTICES, TERRAIN_PATCH_VERTICES, terrainLod.layout, grid, sizeof grid / sizeof grid[0]);
+		if (!terrainLod.indexCount)
+			return false;
+		for (int k = 0; k < terrainLod.indexCount; k++)
+			indices[k] = (GLushort)grid[k]; // the restart index becomes 0xFFFF
+		glGenBuffers(1, &terrainLod.indexVbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainLod.indexVbo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, terrainLod.indexCount * sizeof(GLushort), indices, GL_STATIC_DRAW);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		terrainLod.patches = (terrainPatch_t *)calloc(terrainLod.cacheSize, sizeof(terrainPatch_t));
+		if (!terrainLod.patches)
+			return false;
+		for (int s = 0; s < terrainLod.cacheSize; s++)
+			glGenBuffers(1, &terrainLod.patches[s].vbo);
+	}
+	for (int s = 0; s < terrainLod.cacheSize; s++)
+		terrainLod.patches[s].node = -1;
+	// paged terrain has no whole map to make the normal map from, and quantised terrain is kept
+	// small by deriving its normals per patch
+	if ((terrain.height || terrain.tiled) && !terrainLodNormalMapInit() && terrainLod.normalMap) {
+		glDeleteTextures(1, &terrainLod.normalMap);
+		terrainLod.normalMap = 0;
+	}
+	return true;
+}
+
+// the heights and normals of a node's patch from the resident terrain
+void terrainLodPageFill(int level, int x, int z, terrainPage_t *page) {
+	int step = 1 << (terrainLod.depth - level);
+	int x0 = x * step * TERRAIN_PATCH, z0 = z * step * TERRAIN_PATCH;
+	float spacing = terrain.worldSize / (terrain.size - 1);
+	for (int b = 0; b < TERRAIN_PAGE; b++) {
+		int j = terrainLodSample(z0 + b * step);
+		for (int a = 0; a < TERRAIN_PAGE; a++) {
+			int i = terrainLodSample(x0 + a * step);
+			vec3f normal;
+			normal.x = terrainClamped(i - step, j) - terrainClamped(i + step, j);
+			normal.y = 2.0f * step * spacing;
+			normal.z = terrainClamped(i, j - step) - terrainClamped(i, j + step);
+			normal = normalize(normal);
+			page->height[b * TERRAIN_PAGE + a] = terrainAt(i, j);
+			page->normal[(b * TERRAIN_PAGE + a) * 3] = (GLbyte)lrintf(normal.x * 127.0f);
+			page->normal[(b * TERRAIN_PAGE + a) * 3 + 1] = (GLbyte)lrintf(normal.y * 127.0f);
+			page->normal[(b * TERRAIN_PAGE + a) * 3 + 2] = (GLbyte)lrintf(normal.z * 127.0f);
+		}
+	}
+}
+
+// interleaved position, normal and texture coordinates of every vertex of a node's patch
+void terrainLodPatchVertices(int level, int x, int z, const terrainPage_t *page, GLfloat *v) {
+	int step = 1 << (terrainLod.depth - level);
+	int x0 = x * step * TERRAIN_PATCH, z0 = z * step * TERRAIN_PATCH;
+	float spacing = terrain.worldSize / (terrain.size - 1);
+	for (int b = 0; b < TERRAIN_PATCH_VERTICES; b++) {
+		// the outer ring is the skirt, under the border vertices
+		int gb = b == 0 ? 0 : b == TERRAIN_PATCH_VERTICES - 1 ? TERRAIN_PATCH : b - 1;
+		int j = terrainLodSample(z0 + gb * step);
+		for (int a = 0; a < TERRAIN_PATCH_VERTICES; a++) {
+			int ga = a == 0 ? 0 : a == TERRAIN_PATCH_VERTICES - 1 ? TERRAIN_PATCH : a - 1;
+			int i = terrainLodSample(x0 + ga * step);
+			// nothing hangs from the terrain edge, where there is no neighbour to meet
+			bool skirt = (ga != a - 1 || gb != b - 1) && i > 0 && i < terrain.size - 1 && j > 0 && j < terrain.size - 1;
+			int k = gb * TERRAIN_PAGE + ga;
+			v[0] = i * spacing;
+			v[1] = page->height[k] - (skirt ? terrainLod.skirt : 0.0f);
+			v[2] = j * spacing;
+			v[3] = page->normal[k * 3] / 127.0f;
+			v[4] = page->normal[k * 3 + 1] / 127.0f;
+			v[5] = page->normal[k * 3 + 2] / 127.0f;
+			v[6] = float(i) / (terrain.size - 1);
+			v[7] = float(j) / (terrain.size - 1);
+			v += 8;
+		}
+	}
+}
+
+// the VBO holding a node's patch, building it in the least recently drawn slot if needed;
+// 0 while the page of a paged terrain is still loading
+GLuint terrainLodPatch(int level, int x, int z) {
+	int n = terrainLodNode(level, x, z);
+	int slot = terrainLod.patchOf[n];
+	if (slot < 0) {
+		static terrainPage_t resident;
+		const terrainPage_t *page = &resident;
+		if (terrainResident())
+			terrainLodPageFill(level, x, z, &resident);
+		else if (!(page = terrainPagerGet(n)))
+			return 0;
+		slot = 0;
+		for (int s = 1; s < terrainLod.cacheSize; s++)
+			if (terrainLod.patches[s].lastUsed < terrainLod.patches[slot].lastUsed)
+				slot = s;
+		terrainPatch_t *p = &terrainLod.patches[slot];
+		if (p->node >= 0)
+			terrainLod.patchOf[p->node] = -1;
+		p->node = n;
+		terrainLod.patchOf[n] = slot;
+		static GLfloat vertices[TERRAIN_PATCH_VERTICES * TERRAIN_PATCH_VERTICES * 8];
+		terrainLodPatchVertices(level, x, z, page, vertices);
+		glBindBuffer(GL_ARRAY_BUFFER, p->vbo);
+		glBufferData(GL_ARRAY_BUFFER, sizeof vertices, vertices, GL_STATIC_DRAW);
+		compact.frameUploadBytes += sizeof vertices;
+	}
+	terrainLod.patches[slot].lastUsed = terrainLod.frame;
+	return terrainLod.patches[slot].vbo;
+}
+
+// whether a node's patch can be built now, asking for its page if not
+bool terrainLodPatchReady(int level, int x, int z) {
+	int n = terrainLodNode(level, x, z);
+	if (terrainLod.patchOf[n] < 0)
+		return terrainPagerGet(n) != NULL;
+	// keep it cached until it is drawn
+	terrainLod.patches[terrainLod.patchOf[n]].lastUsed = terrainLod.frame;
+	return true;
+}
+
+// write the terrain as a page file for --terrain-pages
+bool terrainPagerBake() {
+	if (!terrainResident()) {
+		printf("Baking terrain pages needs a heightmap.\n");
+		return false;
+	}
+	FILE *file = fopen(terrainPager.bakeFilename, "wb");
+	if (!file) {
+		printf("Failed to create %s.\n", terrainPager.bakeFilename);
+		return false;
+	}
+	bool ok = terrainLodTree();
+	terrainPageHeader_t header = { { 'I', 'D', 'T', 'P' }, terrain.size, terrainLod.depth, terrain.worldSize };
+	ok = ok && fwrite(&header, sizeof header, 1, file) == 1
+		&& fwrite(terrainLod.error, sizeof(float), terrainLod.nodes, file) == (size_t)terrainLod.nodes
+		&& fwrite(terrainLod.minY, sizeof(float), terrainLod.nodes, file) == (size_t)terrainLod.nodes
+		&& fwrite(terrainLod.maxY, sizeof(float), terrainLod.nodes, file) == (size_t)terrainLod.nodes;
+	for (int level = 0; ok && level <= terrainLod.depth; level++) {
+		for (int z = 0; ok && z < 1 << level; z++) {
+			for (int x = 0; ok && x < 1 << level; x++) {
+				static terrainPage_t page;
+				terrainLodPageFill(level, x, z, &page);
+				ok = fwrite(&page, sizeof page, 1, file) == 1;
+			}
+		}
+	}
+	if (fclose(file) || !ok) {
+		printf("Failed to write %s.\n", terrainPager.bakeFilename);
+		return false;
+	}
+	printf("Wrote %d terrain pages to %s.\n", terrainLod.nodes, terrainPager.bakeFilename);
+	return true;
+}
+
+#define TERRAIN_MAX_PATCHES 1024
+
+// what renderTerrainLod() selects from for the current view
+typedef struct {
+	vec3f eye; // in island coordinates
+	float planes[6][4]; // frustum planes in island coordinates
+	float pixels; // pixels per world unit at unit distance
+	int count;
+	int level[TERRAIN_MAX_PATCHES], x[TERRAIN_MAX_PATCHES], z[TERRAIN_MAX_PATCHES];
+	float rho[TERRAIN_MAX_PATCHES]; // error in pixels
+} terrainView_t;
+
+terrainView_t terrainView;
+
+// select a node if its bounding box is in the view
+void terrainViewAdd(int level, int x, int z) {
+	terrainView_t *v = &terrainView;
+	float span = (TERRAIN_PATCH << (terrainLod.depth - level)) * terrain.worldSize / (terrain.size - 1);
+	float x0 = x * span, z0 = z * span, x1 = x0 + span, z1 = z0 + span;
+	if (x0 >= terrain.worldSize || z0 >= terrain.worldSize)
+		return;
+	x1 = x1 < terrain.worldSize ? x1 : terrain.worldSize;
+	z1 = z1 < terrain.worldSize ? z1 : terrain.worldSize;
+	int n = terrainLodNode(level, x, z);
+	float y0 = terrainLod.minY[n] - terrainLod.skirt, y1 = terrainLod.maxY[n];
+	for (int p = 0; p < 6; p++) {
+		// the box corner furthest along the plane normal
+		float d = v->planes[p][0] * (v->planes[p][0] > 0 ? x1 : x0) + v->planes[p][1] * (v->planes[p][1] > 0 ? y1 : y0)
+			+ v->planes[p][2] * (v->planes[p][2] > 0 ? z1 : z0) + v->planes[p][3];
+		if (d < 0.0f)
+			return;
+	}
+	float dx = v->eye.x < x0 ? x0 - v->eye.x : v->eye.x > x1 ? v->eye.x - x1 : 0.0f;
+	float dy = v->eye.y < y0 ? y0 - v->eye.y : v->eye.y > y1 ? v->eye.y - y1 : 0.0f;
+	float dz = v->eye.z < z0 ? z0 - v->eye.z : v->eye.z > z1 ? v->eye.z - z1 : 0.0f;
+	float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+	v->level[v->count] = level;
+	v->x[v->count] = x;
+	v->z[v->count] = z;
+	v->rho[v->count] = terrainLod.error[n] * v->pixels / (distance > 1e-3f ? distance : 1e-3f);
+	v->count++;
+}
+
+// frustum planes of the current matrices in model coordinates, normals pointing in
+void viewFrustum(float planes[6][4]) {
+	GLfloat mv[16], proj[16], clip[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	glGetFloatv(GL_PROJECTION_MATRIX, proj);
+	// the frustum planes are sums and differences of the rows of proj * mv
+	for (int c = 0; c < 4; c++)
+		for (int r = 0; r < 4; r++)
+			clip[c * 4 + r] = proj[r] * mv[c * 4] + proj[4 + r] * mv[c * 4 + 1] + proj[8 + r] * mv[c * 4 + 2] + proj[12 + r] * mv[c * 4 + 3];
+	for (int p = 0; p < 6; p++)
+		for (int c = 0; c < 4; c++)
+			planes[p][c] = clip[c * 4 + 3] + (p & 1 ? -1.0f : 1.0f) * clip[c * 4 + p / 2];
+}
+
+bool sphereInFrustum(float planes[6][4], vec3f c, float r) {
+	for (int p = 0; p < 6; p++) {
+		float length = sqrtf(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+		if (planes[p][0] * c.x + planes[p][1] * c.y + planes[p][2] * c.z + planes[p][3] < -r * length)
+			return false;
+	}
+	return true;
+}
+
+// draw the terrain in island coordinates as the patches the current view needs
+void renderTerrainLod() {
+	terrainView_t *v = &terrainView;
+	GLfloat mv[16], proj[16];
+	GLint viewport[4];
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+	glGetFloatv(GL_PROJECTION_MATRIX, proj);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	// eye position, assuming no scaling in the modelview matrix
+	v->eye.x = -(mv[0] * mv[12] + mv[1] * mv[13] + mv[2] * mv[14]);
+	v->eye.y = -(mv[4] * mv[12] + mv[5] * mv[13] + mv[6] * mv[14]);
+	v->eye.z = -(mv[8] * mv[12] + mv[9] * mv[13] + mv[10] * mv[14]);
+	v->pixels = proj[5] * viewport[3] / 2.0f;
+	viewFrustum(v->planes);
+	float tau = terrainLod.tau * MAX_TESSELLATION / global.tessellation;
+	terrainLod.frame++;
+	terrainPager.frame = terrainLod.frame;
+	int maxPatches = terrainLod.maxPatches < terrainLod.cacheSize ? terrainLod.maxPatches : terrainLod.cacheSize;
+	maxPatches = maxPatches < TERRAIN_MAX_PATCHES ? maxPatches : TERRAIN_MAX_PATCHES;
+
+	// split the node with the largest error until all are under tau or the budget is spent
+	v->count = 0;
+	terrainViewAdd(0, 0, 0);
+	while (v->count + 3 <= maxPatches) {
+		int worst = -1;
+		for (int k = 0; k < v->count; k++)
+			if (v->level[k] < terrainLod.depth && v->rho[k] > tau && (worst < 0 || v->rho[k] > v->rho[worst]))
+				worst = k;
+		if (worst < 0)
+			break;
+		int level = v->level[worst] + 1, x = v->x[worst] * 2, z = v->z[worst] * 2;
+		if (!terrainResident()) {
+			// a paged node is split once the pages of all its children are in
+			int ready = 0;
+			for (int c = 0; c < 4; c++)
+				ready += terrainLodPatchReady(level, x + (c & 1), z + (c >> 1));
+			if (ready < 4) {
+				v->rho[worst] = -1.0f;
+				continue;
+			}
+		}
+		v->count--;
+		v->level[worst] = v->level[v->count];
+		v->x[worst] = v->x[v->count];
+		v->z[worst] = v->z[v->count];
+		v->rho[worst] = v->rho[v->count];
+		for (int c = 0; c < 4; c++)
+			terrainViewAdd(level, x + (c & 1), z + (c >> 1));
+	}
+
+	terrainLod.drawn = v->count;
+	bool normalMapped = terrainLod.normalMap && !global.wireframeMode;
+	if (normalMapped) {
+		glUseProgram(terrainLod.program);
+		glUniform2f(terrainLod.uNormalScale, (terrain.size - 1) / (terrain.worldSize * terrain.size), 0.5f / terrain.size);
+		glUniform1i(terrainLod.uTextured, glIsEnabled(GL_TEXTURE_2D));
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, terrainLod.normalMap);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	glColor3f(0.4, 0.37, 0.25);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainLod.indexVbo);
+	gridRestart(terrainLod.layout, 0xFFFF, true);
+	for (int k = 0; k < v->count; k++) {
+		GLuint vbo = terrainLodPatch(v->level[k], v->x[k], v->z[k]);
+		if (!vbo)
+			continue;
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glVertexPointer(3, GL_FLOAT, 8 * sizeof(GLfloat), 0);
+		glNormalPointer(GL_FLOAT, 8 * sizeof(GLfloat), (const GLvoid *)(3 * sizeof(GLfloat)));
+		glTexCoordPointer(2, GL_FLOAT, 8 * sizeof(GLfloat), (const GLvoid *)(6 * sizeof(GLfloat)));
+		glDrawElements(gridMode(terrainLod.layout), terrainLod.indexCount, GL_UNSIGNED_SHORT, 0);
+	}
+	gridRestart(terrainLod.layout, 0xFFFF, false);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	if (normalMapped) {
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glActiveTexture(GL_TEXTURE0);
+		glUseProgram(0);
+	}
+}
+
+// island vertices, texture coordinates and indices for the current tessellation
+void buildIsland() {
+	compact.islandVersion++;
 	// create vertex array
-	GLfloat islandVertices[(MAX_TESSELLATION + 1) * (MAX_TESSELLATION + 1) * 3];
 	for (int j = 0; j < global.tessellation + 1; j++) {
 		float z = j * global.step;
 		for (int i = 0; i < global.tessellation + 1; i++) {
 			float x = i * global.step;
 			islandVertices[j * 3 * (global.tessellation + 1) + i * 3] = x;
-			islandVertices[j * 3 * (global.tessellation + 1) + i * 3 + 1] = height[(j * global.next + MAX_TESSELLATION / MIN_TESSELLATION) * LENGTH_HEIGHT + i * global.next + MAX_TESSELLATION / MIN_TESSELLATION];
+			islandVertices[j * 3 * (global.tessellation + 1) + i * 3 + 1] = terrainAt(i * global.next, j * global.next);
 			islandVertices[j * 3 * (global.tessellation + 1) + i * 3 + 2] = z;
 		}
 	}
 
-	// create texture coordinates array
-	GLfloat texcoords[MAX_TESSELLATION * MAX_TESSELLATION * 8];
-	for (int i = 0; i < global.tessellation * global.tessellation; i++) {
-		texcoords[i] = 0.0; texcoords[i + 1] = 1.0;
-		texcoords[i + 2] = 0.0; texcoords[i + 3] = 0.0;
-		texcoords[i + 4] = 1.0; texcoords[i + 5] = 0.0;
-		texcoords[i + 6] = 1.0; texcoords[i + 7] = 1.0;
+	// create texture coordinates array, one texture over the whole island like the other paths
+	for (int j = 0; j < global.tessellation + 1; j++) {
+		for (int i = 0; i < global.tessellation + 1; i++) {
+			islandTexcoords[j * 2 * (global.tessellation + 1) + i * 2] = float(i) / global.tessellation;
+			islandTexcoords[j * 2 * (global.tessellation + 1) + i * 2 + 1] = float(j) / global.tessellation;
+		}
 	}
 
 	// create indices
-	GLuint islandIndices[MAX_TESSELLATION * MAX_TESSELLATION * 6];
-	for (int j = 0; j < global.tessellation; j++) {
-		for (int i = 0; i < global.tessellation; i++) {
-			islandIndices[j * 4 * global.tessellation + i * 4] = j * (global.tessellation + 1) + i;
-			islandIndices[j * 4 * global.tessellation + i * 4 + 1] = (j + 1) * (global.tessellation + 1) + i;
-			islandIndices[j * 4 * global.tessellation + i * 4 + 2] = (j + 1) * (global.tessellation + 1) + i + 1;
-			islandIndices[j * 4 * global.tessellation + i * 4 + 3] = j * (global.tessellation + 1) + i + 1;
-		}
-	}
+	islandLayout = gridLayout();
+	islandIndexCount = gridIndices(global.tessellation + 1, global.tessellation + 1, islandLayout, islandIndices,
+		sizeof islandIndices / sizeof islandIndices[0]);
+}
 
+void renderIsland() {
 	glBindTexture(GL_TEXTURE_2D, textureTerrian);
 	glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
+	if (terrainLod.enabled) {
+		glTranslatef(-terrain.worldSize / 2.0, -2.0, -terrain.worldSize / 2.0);
+		renderTerrainLod();
+		glTranslatef(terrain.worldSize / 2.0, 2.0, terrain.worldSize / 2.0);
+		return;
+	}
+	if (compact.enabled && !global.wireframeMode) {
+		// the island is static, so after the first frame at a tessellation nothing is uploaded
+		compactMeshGrid(&compact.island, global.tessellation + 1, global.tessellation + 1, islandIndices, islandIndexCount);
+		compactMeshData(&compact.island, compact.islandVersion, islandVertices, islandNormals);
+		glTranslatef(-terrain.worldSize / 2.0, -2.0, -terrain.worldSize / 2.0);
+		gridRestart(islandLayout, INDEX_RESTART, true);
+		compactMeshDraw(&compact.island, gridMode(islandLayout), 0.0f, 0.0f, global.step, global.step, RATIO, true, 1.0f / global.tessellation);
+		gridRestart(islandLayout, INDEX_RESTART, false);
+		glTranslatef(terrain.worldSize / 2.0, 2.0, terrain.worldSize / 2.0);
+		return;
+	}
+	compact.frameUploadBytes += (global.tessellation + 1) * (global.tessellation + 1) * 8 * sizeof(GLfloat) + islandIndexCount * sizeof(GLuint);
+
 	// activate and specify pointer to vertex array
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
 	glEnableClientState(GL_VERTEX_ARRAY);
-	glTexCoordPointer(2, GL_FLOAT, 0, texcoords);
+	glTexCoordPointer(2, GL_FLOAT, 0, islandTexcoords);
 	glNormalPointer(GL_FLOAT, 0, islandNormals);
 	glVertexPointer(3, GL_FLOAT, 0, islandVertices);
 
-	glTranslatef(-5.0, -2.0, -5.0);
+	glTranslatef(-terrain.worldSize / 2.0, -2.0, -terrain.worldSize / 2.0);
 	glColor3f(0.4, 0.37, 0.25);
 	// draw island
-	glDrawElements(GL_QUADS, global.tessellation * global.tessellation * 4, GL_UNSIGNED_INT, islandIndices);
-	glTranslatef(5.0, 2.0, 5.0);
+	gridRestart(islandLayout, INDEX_RESTART, true);
+	glDrawElements(gridMode(islandLayout), islandIndexCount, GL_UNSIGNED_INT, islandIndices);
+	gridRestart(islandLayout, INDEX_RESTART, false);
+	glTranslatef(terrain.worldSize / 2.0, 2.0, terrain.worldSize / 2.0);
 
 	// deactivate vertex arrays after drawing
 	glDisableClientState(GL_VERTEX_ARRAY);
@@ -656,6 +4193,28 @@ void renderIsland() {
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 }
 
+// radius of a sphere around an island centre that holds its terrain and fort
+float islandBound() {
+	float h = terrain.heightScale + FORT_H;
+	return sqrtf(world.radius * world.radius + h * h);
+}
+
+// draw every island in the view
+void renderIslands() {
+	float planes[6][4];
+	viewFrustum(planes);
+	for (int k = 0; k < world.count; k++) {
+		islandSite_t *s = &world.sites[k];
+		if (!sphereInFrustum(planes, s->p, islandBound()))
+			continue;
+		glPushMatrix();
+		glTranslatef(s->p.x, s->p.y, s->p.z);
+		glRotatef(s->angleY * 180.0 / M_PI, 0.0, 1.0, 0.0);
+		renderIsland();
+		glPopMatrix();
+	}
+}
+
 void drawBody(float l, float w, float h) {
 	float r = w / 2.0;
 	// base
@@ -952,7 +4511,8 @@ void drawNormal() {
 	glColor3f(1.0, 1.0, 0.0);
 	drawNormalSineWave();
 	glTranslatef(0.0, -1.0, 0.0);
-	drawNormalIsland();
+	if (terrainResident())
+		drawNormalIsland();
 	// draw normal of fort
 	glTranslatef(0.0, 4.0, 0.0);
 	drawNormalCylinder(1.0, 0.25);
@@ -1054,11 +4614,7 @@ void renderCylinder(float r, float h) {
 	glDisableClientState(GL_NORMAL_ARRAY);
 }
 
-void renderCannonball(int i) {
-	GLfloat ballVertices[MAX_TESSELLATION * (MAX_TESSELLATION + 1) * 3];
-	GLfloat ballNormals[MAX_TESSELLATION * (MAX_TESSELLATION + 1) * 3];
-	static float step_theta = 2.0 * M_PI / global.tessellation;
-	static float step_phi = M_PI / global.tessellation;
+void buildCannonball() {
 	for (int j = 0; j <= global.tessellation; j++) {
 		float phi = j / (float)global.tessellation * M_PI;
 		for (int i = 0; i < global.tessellation; i++) {
@@ -1072,7 +4628,6 @@ void renderCannonball(int i) {
 		}
 	}
 
-	GLuint ballIndices[MAX_TESSELLATION * MAX_TESSELLATION * 6];
 	for (int j = 0; j < global.tessellation; j++) {
 		for (int i = 0; i < global.tessellation; i++) {
 			ballIndices[j * global.tessellation * 6 + i * 6] = j * global.tessellation + i;
@@ -1089,6 +4644,9 @@ void renderCannonball(int i) {
 			}
 		}
 	}
+}
+
+void renderCannonball(int i) {
 
 	// activate and specify pointer to vertex array
 	glEnableClientState(GL_NORMAL_ARRAY);
@@ -1106,8 +4664,6 @@ void renderCannonball(int i) {
 }
 
 void drawBoat(int i) {
-	float temp;
-	calcSineWave(sw1, sw2, sw3, sw4, boat[i].p.x, boat[i].p.z, global.t, &boat[i].p.y, false, &temp, &temp, &temp);
 	glTranslatef(boat[i].p.x, boat[i].p.y, boat[i].p.z);
 	glRotatef(boat[i].angle * 180.0 / M_PI, 0.0, 1.0, 0.0);
 	// left side
@@ -1223,10 +4779,210 @@ void drawFort() {
 	glTranslatef(0.0, -3.0, 0.0);
 }
 
-void renderSea() {
-	int tess = global.tessellation * 6;
+/************************************************************************************************
+ * Instanced forts
+ *
+ * The forts of the other islands do not turn or aim, so they share one static mesh, built once
+ * in the shape drawFort() draws with the cannon raised to FORT_MESH_CANNON_ANGLE. With OpenGL 3.3
+ * the forts in view are drawn by a single glDrawArraysInstanced() call, each instance placed and
+ * turned by the vertex shader from a per instance position and heading. Without it, or in
+ * wireframe mode, the mesh is drawn once per fort through the fixed function pipeline.
+ *************************************************************************************************/
+#define FORT_MESH_SEGMENTS 16
+#define FORT_MESH_CANNON_ANGLE float(M_PI / 6.0)
+
+typedef struct {
+	GLuint vbo; // positions and normals of GL_TRIANGLES, 0 when there are no other forts
+	int vertices;
+	GLuint instanceVbo;
+	GLuint program; // 0 when instancing is not available
+	GLint aInstance;
+	std::vector<GLfloat> instances; // x, y, z and heading of each fort in view
+	int drawn; // forts drawn in the last frame
+} fortMesh_t;
+
+fortMesh_t fortMesh;
+
+static const char *fortVertexShader =
+	"attribute vec4 a_instance;\n" // x, y, z, heading
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	float c = cos(a_instance.w), s = sin(a_instance.w);\n"
+	"	mat3 yaw = mat3(c, 0.0, -s, 0.0, 1.0, 0.0, s, 0.0, c);\n"
+	"	v_color = light0(normalize(gl_NormalMatrix * (yaw * gl_Normal)));\n"
+	"	gl_Position = gl_ModelViewProjectionMatrix * vec4(yaw * gl_Vertex.xyz + a_instance.xyz, 1.0);\n"
+	"}\n";
+
+static const char *fortFragmentShader =
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	gl_FragColor = v_color;\n"
+	"}\n";
+
+void fortMeshVertex(std::vector<GLfloat> &v, float x, float y, float z, float nx, float ny, float nz) {
+	GLfloat vertex[6] = { x, y, z, nx, ny, nz };
+	v.insert(v.end(), vertex, vertex + 6);
+}
+
+// a closed cylinder of radius r from y = 0 to h
+void fortMeshCylinder(std::vector<GLfloat> &v, float r, float h) {
+	float step = 2.0f * M_PI / FORT_MESH_SEGMENTS;
+	for (int i = 0; i < FORT_MESH_SEGMENTS; i++) {
+		float c0 = cosf(i * step), s0 = sinf(i * step), c1 = cosf((i + 1) * step), s1 = sinf((i + 1) * step);
+		fortMeshVertex(v, 0.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f);
+		fortMeshVertex(v, r * c0, 0.0f, r * s0, 0.0f, -1.0f, 0.0f);
+		fortMeshVertex(v, r * c1, 0.0f, r * s1, 0.0f, -1.0f, 0.0f);
+		fortMeshVertex(v, 0.0f, h, 0.0f, 0.0f, 1.0f, 0.0f);
+		fortMeshVertex(v, r * c1, h, r * s1, 0.0f, 1.0f, 0.0f);
+		fortMeshVertex(v, r * c0, h, r * s0, 0.0f, 1.0f, 0.0f);
+		fortMeshVertex(v, r * c0, 0.0f, r * s0, c0, 0.0f, s0);
+		fortMeshVertex(v, r * c1, 0.0f, r * s1, c1, 0.0f, s1);
+		fortMeshVertex(v, r * c1, h, r * s1, c1, 0.0f, s1);
+		fortMeshVertex(v, r * c0, 0.0f, r * s0, c0, 0.0f, s0);
+		fortMeshVertex(v, r * c1, h, r * s1, c1, 0.0f, s1);
+		fortMeshVertex(v, r * c0, h, r * s0, c0, 0.0f, s0);
+	}
+}
+
+// the body drawBody() draws: l long in x, a half cylinder of diameter w on a block h high
+void fortMeshBody(std::vector<GLfloat> &v, float l, float w, float h) {
+	// the cross section in y and z, the arc from z = r round to z = -r and then the block
+	float r = w / 2.0f, y[FORT_MESH_SEGMENTS / 2 + 3], z[FORT_MESH_SEGMENTS / 2 + 3];
+	int n = FORT_MESH_SEGMENTS / 2 + 1;
+	for (int i = 0; i < n; i++) {
+		y[i] = r * sinf(i * M_PI / (n - 1));
+		z[i] = r * cosf(i * M_PI / (n - 1));
+	}
+	y[n] = -h, z[n++] = -r;
+	y[n] = -h, z[n++] = r;
+	for (int i = 0; i < n; i++) {
+		int k = (i + 1) % n;
+		// the ends, as fans round the centre of the arc
+		fortMeshVertex(v, 0.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f);
+		fortMeshVertex(v, 0.0f, y[k], z[k], -1.0f, 0.0f, 0.0f);
+		fortMeshVertex(v, 0.0f, y[i], z[i], -1.0f, 0.0f, 0.0f);
+		fortMeshVertex(v, l, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f);
+		fortMeshVertex(v, l, y[i], z[i], 1.0f, 0.0f, 0.0f);
+		fortMeshVertex(v, l, y[k], z[k], 1.0f, 0.0f, 0.0f);
+		// the sides, smooth along the arc and flat along the block
+		bool arc = k < FORT_MESH_SEGMENTS / 2 + 1 && k > 0;
+		float ny = z[i] - z[k], nz = y[k] - y[i], length = sqrtf(ny * ny + nz * nz);
+		float niy = arc ? y[i] / r : ny / length, niz = arc ? z[i] / r : nz / length;
+		float nky = arc ? y[k] / r : ny / length, nkz = arc ? z[k] / r : nz / length;
+		fortMeshVertex(v, 0.0f, y[i], z[i], 0.0f, niy, niz);
+		fortMeshVertex(v, l, y[i], z[i], 0.0f, niy, niz);
+		fortMeshVertex(v, l, y[k], z[k], 0.0f, nky, nkz);
+		fortMeshVertex(v, 0.0f, y[i], z[i], 0.0f, niy, niz);
+		fortMeshVertex(v, l, y[k], z[k], 0.0f, nky, nkz);
+		fortMeshVertex(v, 0.0f, y[k], z[k], 0.0f, nky, nkz);
+	}
+}
+
+// turn the vertices of v from first on about the x axis by angle, then move them by (x, y, z)
+void fortMeshPlace(std::vector<GLfloat> &v, size_t first, float angle, float x, float y, float z) {
+	float c = cosf(angle), s = sinf(angle);
+	for (size_t i = first; i < v.size(); i += 6) {
+		for (int a = 0; a < 6; a += 3) {
+			float py = v[i + a + 1], pz = v[i + a + 2];
+			v[i + a + 1] = py * c - pz * s;
+			v[i + a + 2] = py * s + pz * c;
+		}
+		v[i] += x;
+		v[i + 1] += y;
+		v[i + 2] += z;
+	}
+}
+
+bool fortMeshInit() {
+	std::vector<GLfloat> v;
+	fortMeshCylinder(v, FORT_R, FORT_BASE_H);
+	fortMeshPlace(v, 0, 0.0f, 0.0f, 3.0f, 0.0f);
+	size_t body = v.size();
+	fortMeshBody(v, 1.0f, 1.0f, 0.5f);
+	fortMeshPlace(v, body, 0.0f, -0.5f, 3.75f, 0.0f);
+	size_t cannon = v.size();
+	float a = FORT_MESH_CANNON_ANGLE;
+	fortMeshCylinder(v, 0.2f, CANNON_L);
+	fortMeshPlace(v, cannon, a - M_PI / 2.0, 0.0f, 3.75f + 0.48f * sinf(a), -0.48f * cosf(a));
+	fortMesh.vertices = v.size() / 6;
+	glGenBuffers(1, &fortMesh.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, fortMesh.vbo);
+	glBufferData(GL_ARRAY_BUFFER, v.size() * sizeof(GLfloat), v.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+#ifdef GL_VERSION_3_3
+	const char *version = (const char *)glGetString(GL_VERSION);
+	int major = 0, minor = 0;
+	if (version)
+		sscanf(version, "%d.%d", &major, &minor);
+	if (major > 3 || (major == 3 && minor >= 3))
+		fortMesh.program = buildProgram(fortVertexShader, fortFragmentShader);
+	if (fortMesh.program) {
+		fortMesh.aInstance = glGetAttribLocation(fortMesh.program, "a_instance");
+		glGenBuffers(1, &fortMesh.instanceVbo);
+	}
+#endif
+	if (!fortMesh.program)
+		printf("Instanced forts need OpenGL 3.3; drawing them one by one.\n");
+	return true;
+}
+
+// draw the forts of the other islands that are in the view
+void drawForts() {
+	if (!fortMesh.vbo)
+		return;
+	float planes[6][4];
+	viewFrustum(planes);
+	fortMesh.instances.clear();
+	for (int k = 1; k < world.count; k++) {
+		islandSite_t *s = &world.sites[k];
+		vec3f centre = { s->p.x, s->p.y + FORT_CENTER, s->p.z };
+		if (!sphereInFrustum(planes, centre, FORT_R + FORT_H - FORT_CENTER))
+			continue;
+		GLfloat instance[4] = { s->p.x, s->p.y, s->p.z, s->fortAngleY };
+		fortMesh.instances.insert(fortMesh.instances.end(), instance, instance + 4);
+	}
+	int n = fortMesh.instances.size() / 4;
+	fortMesh.drawn = n;
+	if (!n)
+		return;
+
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, fortMesh.vbo);
+	glVertexPointer(3, GL_FLOAT, 6 * sizeof(GLfloat), 0);
+	glNormalPointer(GL_FLOAT, 6 * sizeof(GLfloat), (const GLvoid *)(3 * sizeof(GLfloat)));
+#ifdef GL_VERSION_3_3
+	if (fortMesh.program && !global.wireframeMode) {
+		glBindBuffer(GL_ARRAY_BUFFER, fortMesh.instanceVbo);
+		glBufferData(GL_ARRAY_BUFFER, fortMesh.instances.size() * sizeof(GLfloat), fortMesh.instances.data(), GL_STREAM_DRAW);
+		glEnableVertexAttribArray(fortMesh.aInstance);
+		glVertexAttribPointer(fortMesh.aInstance, 4, GL_FLOAT, GL_FALSE, 0, 0);
+		glVertexAttribDivisor(fortMesh.aInstance, 1);
+		glUseProgram(fortMesh.program);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, fortMesh.vertices, n);
+		glUseProgram(0);
+		glVertexAttribDivisor(fortMesh.aInstance, 0);
+		glDisableVertexAttribArray(fortMesh.aInstance);
+		n = 0;
+	}
+#endif
+	for (int k = 0; k < n; k++) {
+		const GLfloat *instance = &fortMesh.instances[k * 4];
+		glPushMatrix();
+		glTranslatef(instance[0], instance[1], instance[2]);
+		glRotatef(instance[3] * 180.0 / M_PI, 0.0, 1.0, 0.0);
+		glDrawArrays(GL_TRIANGLES, 0, fortMesh.vertices);
+		glPopMatrix();
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+}
+
+void buildSeaIndices() {
+	int tess = seaGridTess();
 	// create indices
-	GLuint seaIndices[MAX_TESSELLATION * MAX_TESSELLATION * 6 * 36];
 	for (int j = 0; j < tess; j++) {
 		for (int i = 0; i < tess; i++) {
 			seaIndices[j * 6 * tess + i * 6] = seaIndices[j * 6 * tess + i * 6 + 3] = j * (tess + 1) + i;
@@ -1235,6 +4991,23 @@ void renderSea() {
 			seaIndices[j * 6 * tess + i * 6 + 5] = j * (tess + 1) + i + 1;
 		}
 	}
+}
+
+void renderSea() {
+	int tess = seaGridTess();
+
+	if (seaNormalMap.enabled && !global.wireframeMode) {
+		renderSeaNormalMapped();
+		return;
+	}
+
+	if (compact.enabled && !global.wireframeMode) {
+		compactMeshGrid(&compact.sea, tess + 1, tess + 1, seaIndices, tess * tess * 6);
+		compactMeshData(&compact.sea, seaHeight.tick, seaVertices, seaNormals);
+		compactMeshDraw(&compact.sea, GL_TRIANGLES, -RANGE_SEA / 2.0, -RANGE_SEA / 2.0, RANGE_SEA / tess, RANGE_SEA / tess, 1.0f, false, 0.0f);
+		return;
+	}
+	compact.frameUploadBytes += (tess + 1) * (tess + 1) * 6 * sizeof(GLfloat) + tess * tess * 6 * sizeof(GLuint);
 
 	// activate and specify pointer to vertex array
 	glEnableClientState(GL_NORMAL_ARRAY);
@@ -1248,12 +5021,14 @@ void renderSea() {
 	glDisableClientState(GL_NORMAL_ARRAY);
 }
 
-void updateParticles(float dt, int i) {
+// the particles of a sunk boat; they are passed in because the job updating them may run on
+// another thread than the one owning the game state
+void updateParticles(float dt, vec6f *p) {
 	for (int k = 0; k < PARTICLE_NUM; k++) {
-		particle[i][k].p.x += particle[i][k].v.x * dt;
-		particle[i][k].p.y += particle[i][k].v.y * dt;
-		particle[i][k].p.z += particle[i][k].v.z * dt;
-		particle[i][k].v.y += G * dt;
+		p[k].p.x += p[k].v.x * dt;
+		p[k].p.y += p[k].v.y * dt;
+		p[k].p.z += p[k].v.z * dt;
+		p[k].v.y += G * dt;
 	}
 }
 
@@ -1282,8 +5057,7 @@ void moveBoat(float dt, int i) {
 	updateBoatV(dt, i);
 	boat[i].p.x += boat[i].v.x * dt;
 	boat[i].p.z += boat[i].v.z * dt;
-	float temp;
-	calcSineWave(sw1, sw2, sw3, sw4, boat[i].p.x, boat[i].p.z, global.t, &boat[i].p.y, false, &temp, &temp, &temp);
+	boat[i].p.y = seaHeightEntity(i, boat[i].p.x, boat[i].p.z);
  }
 
 void turnBoat(float dt, int i) {
@@ -1366,84 +5140,719 @@ void boatMoveAI(int i) {
 	}
 }
 
-// numerical method
-void updateCannonball(float dt, int i) {
-	ball[i].pv.p.x += ball[i].pv.v.x * dt;
-	ball[i].pv.p.z += ball[i].pv.v.z * dt;
-	ball[i].pv.p.y += ball[i].pv.v.y * dt;
-	ball[i].pv.v.y += G * dt;
+// numerical method
+void updateCannonball(float dt, int i) {
+	ball[i].pv.p.x += ball[i].pv.v.x * dt;
+	ball[i].pv.p.z += ball[i].pv.v.z * dt;
+	ball[i].pv.p.y += ball[i].pv.v.y * dt;
+	ball[i].pv.v.y += G * dt;
+}
+
+// advance the game to the current time; false if it is paused, this was the first tick or no
+// time has passed since the last one
+bool simTick() {
+	static float lastT = -1.0;
+	float dt;
+
+	if (!global.go)
+		return false;
+	global.t = gameClockTick(&global.gameClock);
+
+	// the first tick, or the game went back to an earlier state
+	if (lastT < 0.0 || global.t < lastT) {
+		lastT = global.t;
+		return false;
+	}
+
+	dt = global.t - lastT;
+	if (dt <= 0.0f)
+		return false;
+	lastT = global.t;
+	if (global.debug)
+		printf("%f %f\n", global.t, dt);
+	long long tickStart = clockNs();
+	PROFILE_ZONE("tick");
+
+	// the sea, what the boats do next and the particles of sunk boats do not depend on each
+	// other; the boats decide from where they all are at the start of the tick
+	vec6f (*particles)[PARTICLE_NUM] = particle;
+	bool sunk[MAX_BOAT_NUM];
+	for (int i = 0; i < MAX_BOAT_NUM; i++) {
+		sunk[i] = boat[i].isHit;
+		if (sunk[i] && !boat[i].particleUpdated) {
+			for (int k = 0; k < PARTICLE_NUM; k++)
+				particle[i][k].p = boat[i].p;
+			boat[i].particleUpdated = true;
+		}
+	}
+	job_t *stages[] = {
+		jobCreate("sea", seaGridBuild(), false),
+		jobCreate("boat AI", [] {
+			for (int i = 0; i < MAX_BOAT_NUM; i++)
+				if (!boat[i].isHit)
+					boatMoveAI(i);
+		}, true),
+		jobCreate("particles", [=] {
+			for (int i = 0; i < MAX_BOAT_NUM; i++)
+				if (sunk[i])
+					updateParticles(dt, particles[i]);
+		}, false),
+	};
+	jobGraph(stages, sizeof stages / sizeof stages[0]);
+
+	// update island cannonball
+	vec3f from = ball[ISLAND].pv.p;
+	float t;
+	if (ball[ISLAND].fire)
+		updateCannonball(dt, ISLAND);
+	// when island cannonball hits anything except the sea, it disappears
+	if (ball[ISLAND].pv.p.y < calcHeight(calcActualPositionIsland(ball[ISLAND].pv.p))
+		|| (ball[ISLAND].fire && (worldCast(calcActualPositionIsland(from), calcActualPositionIsland(ball[ISLAND].pv.p), &t)
+		|| worldHitFort(calcActualPositionIsland(ball[ISLAND].pv.p))))) {
+		ball[ISLAND].fire = false;
+	}
+	for (int i = 0; i < MAX_BOAT_NUM; i++) {
+		if (!boat[i].isHit) {
+			// moving from the distant position towards the island
+			updateBoat(dt, i);
+			// fire the cannonball
+			if (!ball[i].fire)
+				initialBall(i);
+		}
+		from = ball[i].pv.p;
+		if (ball[i].fire)
+			updateCannonball(dt, i);
+		// when boat cannonball hits anything except the sea, it disappears; the forts of other
+		// islands stop it but only the player's shots count against them
+		if (ball[i].pv.p.y < calcHeight(ball[i].pv.p) || (ball[i].fire && (worldCast(from, ball[i].pv.p, &t) || worldFortAt(ball[i].pv.p) > 0)))
+			ball[i].fire = false;
+		// check if the boat cannonball hits the island
+		if (checkHit(ball[i].pv) == ISLAND) {
+			if (global.islandHitCount <= 4000)
+				global.islandHitCount++;
+			else
+				global.loose = true;
+		}
+		for (int k = 0; k < PARTICLE_NUM; k++)
+			if (particle[i][k].p.y < calcHeight(particle[i][k].p))
+				particle[i][k].p.y = -100000.0;
+	}
+	// check if the island cannonball hits a boat
+	int boatHit = checkHit(ball[ISLAND].pv);
+	if (boatHit >= 0 && boatHit != ISLAND) {
+		boat[boatHit].isHit = true;
+		global.score++;
+		if (global.score == MAX_BOAT_NUM)
+			global.win = true;
+	}
+	floatBoats();
+	if (global.win || global.loose)
+		global.go = false;
+	global.bloodChanged = true;
+
+	// tick rate
+	stopwatchStop(STOPWATCH_SIM, tickStart);
+	global.ticks++;
+	float now = clockSeconds();
+	dt = now - global.lastTickRateT;
+	if (dt > global.frameRateInterval) {
+		global.tickRate = global.ticks / dt;
+		global.lastTickRateT = now;
+		global.ticks = 0;
+	}
+	return true;
+}
+
+/************************************************************************************************
+ * GPU timers
+ *
+ * With --gpu-timing each render pass of display() is wrapped in a GL_TIME_ELAPSED query. GL
+ * runs behind the CPU, so asking for a result straight away would wait for the GPU to finish the
+ * frame. Every pass instead has GPU_LATENCY queries used in turn, and a query is only read just
+ * before it is reused, GPU_LATENCY frames after it was issued, when the result is almost always
+ * there. A result that is still not there is dropped rather than waited for.
+ *
+ * Time elapsed queries cannot nest, so the passes follow one another: the boats pass takes in
+ * their cannonballs and trajectories, the trajectories pass the fort's cannonball and aim line.
+ * The OSD shows the GPU time of each pass next to the CPU time spent submitting it.
+ *
+ * llvmpipe answers timer queries with next to nothing, as it rasterises when the frame is
+ * flushed rather than as the pass is drawn. --gpu-timing finish times each pass with glFinish()
+ * on both sides instead: it stalls the pipeline at every pass and costs frame rate, but on a
+ * software renderer it measures how long each pass really takes to rasterise.
+ *************************************************************************************************/
+#define GPU_LATENCY 4 // frames a query is in flight
+
+enum { GPU_SKY, GPU_ISLANDS, GPU_BOATS, GPU_FORTS, GPU_TRAJECTORIES, GPU_SEA, GPU_OSD, GPU_PASS_NUM };
+
+const char *gpuPassNames[GPU_PASS_NUM] = { "sky", "islands", "boats", "forts", "trajectories", "sea", "osd" };
+
+typedef struct {
+	bool enabled; // --gpu-timing, cleared without timer queries
+	bool finish; // --gpu-timing finish, time passes with glFinish()
+	GLuint queries[GPU_LATENCY][GPU_PASS_NUM];
+	bool issued[GPU_LATENCY][GPU_PASS_NUM];
+	int frame; // frames timed
+	int pass; // pass being timed, -1 between passes
+	long long passStart; // clockNs() at the start of the pass
+	double gpuTotal[GPU_PASS_NUM], cpuTotal[GPU_PASS_NUM]; // nanoseconds since the last report
+	int results[GPU_PASS_NUM]; // GPU results since the last report
+	int dropped; // results not ready in time
+	float gpuMs[GPU_PASS_NUM], cpuMs[GPU_PASS_NUM]; // per frame as shown
+	float lastMs[GPU_PASS_NUM]; // the latest GPU result, for the metrics log
+} gpuTimer_t;
+
+gpuTimer_t gpuTimer = { false, false, {}, {}, 0, -1 };
+
+// needs GL 3.3 or ARB_timer_query
+bool gpuTimerInit() {
+	if (gpuTimer.finish)
+		return true;
+#ifdef GL_VERSION_3_3
+	const char *version = (const char *)glGetString(GL_VERSION);
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	int major = 0, minor = 0;
+	if (version)
+		sscanf(version, "%d.%d", &major, &minor);
+	if (major > 3 || (major == 3 && minor >= 3) || (extensions && strstr(extensions, "GL_ARB_timer_query"))) {
+		glGenQueries(GPU_LATENCY * GPU_PASS_NUM, &gpuTimer.queries[0][0]);
+		return true;
+	}
+#endif
+	printf("GPU timing needs timer queries, which this OpenGL lacks.\n");
+	gpuTimer.enabled = false;
+	return false;
+}
+
+// collect the results of the queries about to be reused, at the start of a frame
+void gpuTimerFrame() {
+	if (!gpuTimer.enabled || gpuTimer.finish)
+		return;
+#ifdef GL_VERSION_3_3
+	int slot = ++gpuTimer.frame % GPU_LATENCY;
+	for (int p = 0; p < GPU_PASS_NUM; p++) {
+		if (!gpuTimer.issued[slot][p])
+			continue;
+		GLint available = 0;
+		glGetQueryObjectiv(gpuTimer.queries[slot][p], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(gpuTimer.queries[slot][p], GL_QUERY_RESULT, &ns);
+			gpuTimer.gpuTotal[p] += ns;
+			gpuTimer.lastMs[p] = ns * 1e-6f;
+			gpuTimer.results[p]++;
+		} else {
+			gpuTimer.dropped++;
+		}
+		gpuTimer.issued[slot][p] = false;
+	}
+#endif
+}
+
+void gpuTimerBegin(int pass) {
+	if (!gpuTimer.enabled)
+		return;
+	if (gpuTimer.finish) {
+		glFinish();
+	} else {
+#ifdef GL_VERSION_3_3
+		int slot = gpuTimer.frame % GPU_LATENCY;
+		glBeginQuery(GL_TIME_ELAPSED, gpuTimer.queries[slot][pass]);
+		gpuTimer.issued[slot][pass] = true;
+#endif
+	}
+	gpuTimer.pass = pass;
+	gpuTimer.passStart = clockNs();
+}
+
+void gpuTimerEnd() {
+	if (!gpuTimer.enabled || gpuTimer.pass < 0)
+		return;
+	int pass = gpuTimer.pass;
+	long long end = clockNs();
+	gpuTimer.cpuTotal[pass] += end - gpuTimer.passStart;
+	if (gpuTimer.finish) {
+		glFinish();
+		long long ns = clockNs() - gpuTimer.passStart;
+		gpuTimer.gpuTotal[pass] += ns;
+		gpuTimer.lastMs[pass] = ns * 1e-6f;
+		gpuTimer.results[pass]++;
+	} else {
+#ifdef GL_VERSION_3_3
+		glEndQuery(GL_TIME_ELAPSED);
+#endif
+	}
+	gpuTimer.pass = -1;
+}
+
+// the GPU and CPU time per frame of each pass over the last frames frames, for the OSD
+void gpuTimerTake(int frames) {
+	for (int p = 0; p < GPU_PASS_NUM; p++) {
+		gpuTimer.gpuMs[p] = gpuTimer.results[p] ? gpuTimer.gpuTotal[p] * 1e-6 / gpuTimer.results[p] : 0.0f;
+		gpuTimer.cpuMs[p] = frames ? gpuTimer.cpuTotal[p] * 1e-6 / frames : 0.0f;
+		gpuTimer.gpuTotal[p] = gpuTimer.cpuTotal[p] = 0.0;
+		gpuTimer.results[p] = 0;
+	}
+}
+
+/************************************************************************************************
+ * Offscreen
+ *
+ * The render benchmark draws into an EGL pbuffer, so it runs with no window and no display
+ * server, on llvmpipe on a machine with no GPU. Without a display server Mesa is asked for its
+ * surfaceless platform. Builds without EGL (-DOFFSCREEN_EGL=0, and by default on Windows and
+ * OS X) draw the benchmark in a GLUT window instead.
+ *
+ * Benchmark frames leave out the OSD, which needs GLUT's bitmap fonts, and end in glFinish()
+ * rather than a swap, so each frame's time includes rasterising it.
+ *************************************************************************************************/
+typedef struct {
+	bool benchmarking; // display() draws benchmark frames
+} offscreen_t;
+
+offscreen_t offscreen = { false };
+
+// make a WIDTH x HEIGHT pbuffer context current; false without EGL or a way to render
+bool offscreenContext() {
+#if OFFSCREEN_EGL
+	if (!getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY"))
+		setenv("EGL_PLATFORM", "surfaceless", 0);
+	EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+		printf("Failed to initialise EGL.\n");
+		return false;
+	}
+	const EGLint configAttribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE };
+	const EGLint surfaceAttribs[] = { EGL_WIDTH, WIDTH, EGL_HEIGHT, HEIGHT, EGL_NONE };
+	EGLConfig config;
+	EGLint count = 0;
+	if (!eglChooseConfig(display, configAttribs, &config, 1, &count) || count < 1) {
+		printf("No EGL configuration renders OpenGL into a pbuffer.\n");
+		return false;
+	}
+	EGLSurface surface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+	EGLContext context = EGL_NO_CONTEXT;
+	if (surface != EGL_NO_SURFACE && eglBindAPI(EGL_OPENGL_API))
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context)) {
+		printf("Failed to create an EGL pbuffer context.\n");
+		return false;
+	}
+	printf("%s, OpenGL %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+	return true;
+#else
+	return false;
+#endif
+}
+
+/************************************************************************************************
+ * Frame pacing
+ *
+ * The idle callback would otherwise run flat out, ticking and redrawing far more often than the
+ * display shows. With a target of pacer.fps frames per second it sleeps until the next frame is
+ * due instead. Sleeps overshoot by a scheduler dependent amount, so the pacer sleeps until
+ * pacer.slack before the deadline and yields for the rest; slack follows the largest overshoot
+ * seen lately, so the wait stays accurate to well under a millisecond without spinning for long.
+ * An overshoot counts for at most a quarter of a frame, and slack decays by a tenth per sleep,
+ * so a sleep the scheduler holds up for a whole frame or more soon stops costing CPU.
+ * A frame that comes late moves the deadlines on rather than hurrying the next frames.
+ * --fps 0 turns pacing off for benchmarks.
+ *
+ * The OSD shows the process CPU time per frame over all threads next to the frame rate.
+ *************************************************************************************************/
+typedef struct {
+	float fps; // --fps, 0 for uncapped
+	double next; // when the next frame is due, 0 before the first
+	double slack; // how long before the deadline to stop sleeping
+	double lastCpu; // process CPU time at the last frame rate update
+	float cpuMs; // process CPU time per frame
+} pacer_t;
+
+pacer_t pacer = { 60.0f, 0.0, 0.001 };
+
+// CPU time of all threads of the process in seconds
+double pacerCpu() {
+#if _WIN32
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		return 0.0;
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return (k.QuadPart + u.QuadPart) * 1e-7;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// sleep until the next frame is due
+void pacerWait() {
+	if (pacer.fps <= 0.0f)
+		return;
+	double period = 1.0 / pacer.fps, now = clockSeconds();
+	if (now - pacer.next > period)
+		pacer.next = now;
+	for (double left = pacer.next - now; left > 0.0; left = pacer.next - now) {
+		if (left > pacer.slack) {
+			double asked = left - pacer.slack;
+			std::this_thread::sleep_for(std::chrono::duration<double>(asked));
+			// a preempted sleep must not leave the pacer yielding for whole frames
+			double over = clockSeconds() - now - asked;
+			over = over < period / 4.0 ? over : period / 4.0;
+			pacer.slack = over > pacer.slack * 0.9 ? over : pacer.slack * 0.9;
+		} else {
+			std::this_thread::yield();
+		}
+		now = clockSeconds();
+	}
+	pacer.next += period;
+}
+
+// Idle callback for animation
+void update() {
+	pacerWait();
+	if (simTick())
+		glutPostRedisplay();
+}
+
+// the launch of the island cannonball for the current aim
+void calcAim() {
+	island.p = { ISLAND_BALL_X, ISLAND_BALL_Y, ISLAND_BALL_Z };
+	island.v = { ISLAND_BALL_VX, ISLAND_BALL_VY, ISLAND_BALL_VZ };
+}
+
+/************************************************************************************************
+ * Metrics
+ *
+ * --metrics <file> writes one CSV row per frame: the frame time from the start of the previous
+ * frame, the simulation and render time, the draw counts, the bytes handed to GL, the live
+ * boats, cannonballs and particles, and the process CPU time. With --gpu-timing the latest GPU
+ * time of each pass is added; it trails the frame by GPU_LATENCY frames.
+ *
+ * --metrics-summary <file> prints the percentiles of every column of such a file and exits, so
+ * two runs can be compared; the run that writes a file prints the same when it quits. The first
+ * row has no frame time, as there is no previous frame, and empty cells are left out.
+ *************************************************************************************************/
+#define METRICS_COLUMNS 32 // columns a summary reads
+
+typedef struct {
+	const char *filename; // --metrics
+	const char *summaryFilename; // --metrics-summary
+	FILE *file;
+	long frame;
+	long long lastStart; // clockNs() at the start of the last frame
+	long long lastSim; // stopwatch lifetime total at the last frame
+	double lastCpu; // pacerCpu() at the last frame
+} metrics_t;
+
+metrics_t metrics = { NULL, NULL, NULL };
+
+bool metricsOpen() {
+	if (!(metrics.file = fopen(metrics.filename, "w"))) {
+		printf("Failed to write %s.\n", metrics.filename);
+		return false;
+	}
+	fprintf(metrics.file, "frame,t,frame_ms,sim_ms,render_ms,cpu_ms,batches,vertices,upload_bytes,boats,balls,particles");
+	if (gpuTimer.enabled)
+		for (int p = 0; p < GPU_PASS_NUM; p++)
+			fprintf(metrics.file, ",gpu_%s_ms", gpuPassNames[p]);
+	fprintf(metrics.file, "\n");
+	metrics.lastSim = stopwatches[STOPWATCH_SIM].lifetime.load();
+	metrics.lastCpu = pacerCpu();
+	return true;
+}
+
+// write the row of a frame that started at start, a clockNs(), and has just been swapped
+void metricsFrame(long long start) {
+	if (!metrics.file)
+		return;
+	long long now = clockNs(), sim = stopwatches[STOPWATCH_SIM].lifetime.load();
+	double cpu = pacerCpu();
+	int boats = 0, balls = 0, particles = 0;
+	for (int i = 0; i < MAX_BOAT_NUM; i++) {
+		if (!boat[i].isHit)
+			boats++;
+		else if (boat[i].particleUpdated)
+			particles += PARTICLE_NUM;
+	}
+	for (int i = 0; i <= ISLAND; i++)
+		balls += ball[i].fire;
+	fprintf(metrics.file, "%ld,%.6f,", metrics.frame++, start * 1e-9);
+	// the first frame has no previous one to be timed from
+	if (metrics.lastStart)
+		fprintf(metrics.file, "%.3f", (start - metrics.lastStart) * 1e-6);
+	fprintf(metrics.file, ",%.3f,%.3f,%.3f,%ld,%ld,%ld,%d,%d,%d", (sim - metrics.lastSim) * 1e-6,
+		(now - start) * 1e-6, (cpu - metrics.lastCpu) * MILLI, drawCount.batches, drawCount.vertices,
+		compact.frameUploadBytes, boats, balls, particles);
+	if (gpuTimer.enabled)
+		for (int p = 0; p < GPU_PASS_NUM; p++)
+			fprintf(metrics.file, ",%.3f", gpuTimer.lastMs[p]);
+	fprintf(metrics.file, "\n");
+	metrics.lastStart = start;
+	metrics.lastSim = sim;
+	metrics.lastCpu = cpu;
+}
+
+int compareDouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// the q quantile of sorted values
+double percentile(const std::vector<double> &sorted, double q) {
+	return sorted[(size_t)(q * (sorted.size() - 1) + 0.5)];
+}
+
+// print the mean and percentiles of every column of a metrics file
+bool metricsSummary(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		printf("Failed to read %s.\n", filename);
+		return false;
+	}
+	char line[1024], names[METRICS_COLUMNS][32];
+	std::vector<double> columns[METRICS_COLUMNS];
+	int count = 0;
+	if (fgets(line, sizeof line, f))
+		for (char *name = strtok(line, ",\r\n"); name && count < METRICS_COLUMNS; name = strtok(NULL, ",\r\n"))
+			snprintf(names[count++], sizeof names[0], "%s", name);
+	// an empty cell, like the frame time of the first frame, has no value to count
+	while (fgets(line, sizeof line, f)) {
+		char *value = line;
+		for (int c = 0; c < count && value; c++) {
+			char *end = value + strcspn(value, ",\r\n");
+			char separator = *end;
+			*end = '\0';
+			if (*value)
+				columns[c].push_back(atof(value));
+			value = separator == ',' ? end + 1 : NULL;
+		}
+	}
+	fclose(f);
+	printf("%s: %d frames\n", filename, count ? (int)columns[0].size() : 0);
+	printf("%-20s %9s %9s %9s %9s %9s %9s\n", "", "mean", "p50", "p90", "p95", "p99", "max");
+	// the first two columns number and time the frames
+	for (int c = 2; c < count; c++) {
+		std::vector<double> &v = columns[c];
+		if (v.empty())
+			continue;
+		qsort(v.data(), v.size(), sizeof(double), compareDouble);
+		double sum = 0.0;
+		for (size_t k = 0; k < v.size(); k++)
+			sum += v[k];
+		const double at[] = { 0.5, 0.9, 0.95, 0.99, 1.0 };
+		printf("%-20s %9.3f", names[c], sum / v.size());
+		for (int k = 0; k < 5; k++)
+			printf(" %9.3f", percentile(v, at[k]));
+		printf("\n");
+	}
+	return true;
+}
+
+void metricsClose() {
+	if (!metrics.file)
+		return;
+	fclose(metrics.file);
+	metrics.file = NULL;
+	metricsSummary(metrics.filename);
+}
+
+/************************************************************************************************
+ * Simulation thread
+ *
+ * With --sim-thread the game runs on a thread of its own instead of in the idle callback, so a
+ * slow frame does not slow the game down and a slow tick does not hold up drawing. The game
+ * state (global, boat, ball, particle, island and the sea grid) is thread_local, so the
+ * simulation thread has its own copy to work on and the code that moves it stays the same.
+ * After every tick it publishes a copy into a triple buffer of snapshots, and display() copies
+ * the newest one into the state it draws. Each side owns one slot and they swap the third with
+ * one atomic exchange, so neither ever waits for the other.
+ *
+ * The render thread keeps its own view settings and derived meshes. Game keys go to the
+ * simulation thread through sim.keys, the one place the two share a lock. The wave model and
+ * the sea grid resolution belong to the simulation, so they cannot be switched while it runs,
+ * and the normal mapped sea gets its texels with each snapshot. Paged terrain is loaded and
+ * evicted by what is drawn, so the simulation thread needs resident terrain.
+ *************************************************************************************************/
+#define SIM_KEY_SPECIAL 0x100 // marks GLUT special keys among the queued keys
+#define SIM_FRESH 4 // set in sim.middle when its slot has not been drawn yet
+
+typedef struct {
+	global_t global;
+	vec6f island;
+	boat_t boat[MAX_BOAT_NUM];
+	cannonball_t ball[MAX_BOAT_NUM + 1];
+	vec6f particle[MAX_BOAT_NUM][PARTICLE_NUM];
+	seaHeight_t seaHeight;
+	GLfloat seaVertices[SEA_GRID_FLOATS], seaNormals[SEA_GRID_FLOATS];
+	GLubyte *texels; // normal mapped sea texels, NULL without
+} simSnapshot_t;
+
+typedef struct {
+	bool enabled; // --sim-thread
+	float rate; // --sim-rate ticks per second, 0 to tick as fast as possible
+	std::thread *thread; // NULL while the game runs in the idle callback
+	std::atomic<bool> quit;
+	std::atomic<int> middle; // the slot between the two threads, | SIM_FRESH once published
+	int write, read; // the slots of the simulation and the render thread
+	std::mutex lock; // guards keys
+	std::vector<int> keys;
+} sim_t;
+
+sim_t sim = { false, 0.0f };
+simSnapshot_t simSlots[3];
+
+void keyboardGame(int key);
+
+// copy this thread's game state into a snapshot
+void simSave(simSnapshot_t *s) {
+	s->global = global;
+	s->island = island;
+	memcpy(s->boat, boat, sizeof boat);
+	memcpy(s->ball, ball, sizeof ball);
+	memcpy(s->particle, particle, sizeof particle);
+	s->seaHeight = seaHeight;
+	int count = (seaHeight.gridTess + 1) * (seaHeight.gridTess + 1) * 3;
+	memcpy(s->seaVertices, seaVertices, count * sizeof(GLfloat));
+	memcpy(s->seaNormals, seaNormals, count * sizeof(GLfloat));
+	if (s->texels)
+		seaNormalMapTexels(s->texels);
+}
+
+// make a snapshot the game state of this thread
+void simLoad(const simSnapshot_t *s) {
+	global = s->global;
+	island = s->island;
+	memcpy(boat, s->boat, sizeof boat);
+	memcpy(ball, s->ball, sizeof ball);
+	memcpy(particle, s->particle, sizeof particle);
+	seaHeight = s->seaHeight;
+	int count = (seaHeight.gridTess + 1) * (seaHeight.gridTess + 1) * 3;
+	memcpy(seaVertices, s->seaVertices, count * sizeof(GLfloat));
+	memcpy(seaNormals, s->seaNormals, count * sizeof(GLfloat));
+}
+
+// hand the state after a tick to the render thread
+void simPublish() {
+	PROFILE_ZONE("publish");
+	simSave(&simSlots[sim.write]);
+	sim.write = sim.middle.exchange(sim.write | SIM_FRESH) & ~SIM_FRESH;
+}
+
+// apply the keys queued since the last tick; true if there were any
+bool simKeys() {
+	std::vector<int> keys;
+	{
+		std::lock_guard<std::mutex> guard(sim.lock);
+		keys.swap(sim.keys);
+	}
+	for (size_t k = 0; k < keys.size(); k++)
+		keyboardGame(keys[k]);
+	return !keys.empty();
+}
+
+void simLoop() {
+	simLoad(&simSlots[sim.middle.load() & ~SIM_FRESH]);
+	double period = sim.rate > 0.0f ? 1.0 / sim.rate : 0.0;
+	auto next = std::chrono::steady_clock::now();
+	while (!sim.quit.load()) {
+		bool changed = simKeys() || global.dirty;
+		if (global.dirty & DIRTY_AIM)
+			calcAim();
+		global.dirty = 0;
+		if (simTick() || changed) {
+			seaGridUpdate();
+			simPublish();
+		} else {
+			// paused, or the clock has not moved on
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if (period > 0.0) {
+			next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(period));
+			std::this_thread::sleep_until(next);
+		}
+	}
+}
+
+// hand the game as the main thread set it up to a new simulation thread
+bool simStart() {
+	if (!terrainResident()) {
+		printf("The simulation thread needs resident terrain, not --terrain-pages.\n");
+		return false;
+	}
+	seaGridUpdate();
+	for (int k = 0; k < 3; k++)
+		if (seaNormalMap.enabled && !(simSlots[k].texels = (GLubyte *)malloc(seaNormalMap.size * seaNormalMap.size * 3)))
+			return false;
+	simSave(&simSlots[2]);
+	sim.write = 0;
+	sim.read = 1;
+	sim.middle = 2;
+	sim.quit = false;
+	sim.thread = new std::thread(simLoop);
+	return true;
 }
 
-// Idle callback for animation
-void update() {
-	static float lastT = -1.0;
-	float dt;
-
-	if (!global.go)
+void simStop() {
+	if (!sim.thread)
 		return;
-	global.t = glutGet(GLUT_ELAPSED_TIME) / MILLI - global.pauseIntervel - global.startTime;
+	sim.quit = true;
+	sim.thread->join();
+	delete sim.thread;
+	sim.thread = NULL;
+}
 
-	if (lastT < 0.0) {
-		lastT = global.t;
+// queue a game key for the simulation thread, or apply it without one
+void simKey(int key) {
+	if (!sim.thread) {
+		keyboardGame(key);
 		return;
 	}
+	std::lock_guard<std::mutex> guard(sim.lock);
+	sim.keys.push_back(key);
+}
 
-	dt = global.t - lastT;
-	lastT = global.t;
-	if (global.debug)
-		printf("%f %f\n", global.t, dt);
-
-	// update island cannonball
-	if (ball[ISLAND].fire)
-		updateCannonball(dt, ISLAND);
-	// when island cannonball hits anything except the sea, it disappears
-	if (ball[ISLAND].pv.p.y < calcHeight(calcActualPositionIsland(ball[ISLAND].pv.p))) {
-		ball[ISLAND].fire = false;
-	}
-	for (int i = 0; i < MAX_BOAT_NUM; i++) {
-		if (!boat[i].isHit) {
-			// moving from the distant position towards the island
-			boatMoveAI(i);
-			updateBoat(dt, i);
-			// fire the cannonball
-			if (!ball[i].fire)
-				initialBall(i);
-		}
-		if (ball[i].fire)
-			updateCannonball(dt, i);
-		// when boat cannonball hits anything except the sea, it disappears
-		if (ball[i].pv.p.y < calcHeight(ball[i].pv.p))
-			ball[i].fire = false;
-		// check if the boat cannonball hits the island
-		if (checkHit(ball[i].pv) == ISLAND) {
-			if (global.islandHitCount <= 4000)
-				global.islandHitCount++;
-			else
-				global.loose = true;
-		}
-		if (boat[i].isHit) {
-			if (!boat[i].particleUpdated) {
-				for (int k = 0; k < PARTICLE_NUM; k++)
-					particle[i][k].p = boat[i].p;
-				boat[i].particleUpdated = true;
-			}
-			updateParticles(dt, i);
-		}
-		for (int k = 0; k < PARTICLE_NUM; k++)
-			if (particle[i][k].p.y < calcHeight(particle[i][k].p))
-				particle[i][k].p.y = -100000.0;
-	}
-	global.bloodChanged = true;
+// make the newest snapshot, if there is one, the state to draw
+void simConsume() {
+	if (!sim.thread || !(sim.middle.load() & SIM_FRESH))
+		return;
+	PROFILE_ZONE("consume");
+	sim.read = sim.middle.exchange(sim.read) & ~SIM_FRESH;
+	global_t view = global;
+	simLoad(&simSlots[sim.read]);
+	// the render thread keeps its view settings, frame counts and derived meshes
+	global.debug = view.debug;
+	global.wireframeMode = view.wireframeMode;
+	global.lastFrameRateT = view.lastFrameRateT;
+	global.frameRate = view.frameRate;
+	global.frames = view.frames;
+	global.next = view.next;
+	global.step = view.step;
+	global.thetaStep = view.thetaStep;
+	global.dirty = view.dirty;
+	if (global.tessellation != view.tessellation)
+		global.dirty |= DIRTY_TESSELLATION;
+	if (global.rAngle != view.rAngle)
+		global.dirty |= DIRTY_AIM;
+}
 
-	// frame rate
-	dt = global.t - global.lastFrameRateT;
-	if (dt > global.frameRateInterval) {
-		global.frameRate = global.frames / dt;
-		global.lastFrameRateT = global.t;
-		global.frames = 0;
-	}
+// the normal mapped sea texels of the snapshot being drawn, NULL without the simulation thread
+const GLubyte *simTexels() {
+	return sim.thread ? simSlots[sim.read].texels : NULL;
+}
 
-	glutPostRedisplay();
+// idle callback with the simulation thread: draw when a frame is due and there is a new snapshot
+void simIdle() {
+	pacerWait();
+	if (sim.middle.load() & SIM_FRESH)
+		glutPostRedisplay();
+	else if (pacer.fps <= 0.0f)
+		std::this_thread::yield();
 }
 
 void renderOSD() {
@@ -1486,6 +5895,59 @@ void renderOSD() {
 	for (bufp = buffer; *bufp; bufp++)
 		glutBitmapCharacter(GLUT_BITMAP_HELVETICA_18, *bufp);
 
+	if (world.count > 1) {
+		glRasterPos2i(30, 500);
+		snprintf(buffer, sizeof buffer, "Forts hit: %d/%d", global.fortsHit, world.count - 1);
+		for (bufp = buffer; *bufp; bufp++)
+			glutBitmapCharacter(GLUT_BITMAP_HELVETICA_18, *bufp);
+	}
+
+	glRasterPos2i(30, 470);
+	if (sim.thread)
+		snprintf(buffer, sizeof buffer, "%.0f ticks/s, %.0f frames/s, %.1f ms CPU", global.tickRate, global.frameRate, pacer.cpuMs);
+	else
+		snprintf(buffer, sizeof buffer, "%.0f frames/s, %.1f ms CPU", global.frameRate, pacer.cpuMs);
+	for (bufp = buffer; *bufp; bufp++)
+		glutBitmapCharacter(GLUT_BITMAP_HELVETICA_18, *bufp);
+	glRasterPos2i(30, 450);
+	snprintf(buffer, sizeof buffer, "tick %.2f ms, frame %.2f ms", timing.simMs, timing.renderMs);
+	for (bufp = buffer; *bufp; bufp++)
+		glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *bufp);
+
+	// time per frame of the profiled zones of each thread
+	for (int k = 0; k < profiler.totalCount; k++) {
+		const profileTotal_t *zone = &profiler.totals[k];
+		glColor3f(0.6, 1.0, 0.6);
+		glRasterPos2i(w - 260 + zone->depth * 10, h - 20 - k * 14);
+		snprintf(buffer, sizeof buffer, "%d %s: %.2f ms", zone->thread, zone->name, zone->ms);
+		for (bufp = buffer; *bufp; bufp++)
+			glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *bufp);
+	}
+
+	// GPU time of each render pass and CPU time submitting it
+	if (gpuTimer.enabled) {
+		glColor3f(1.0, 0.8, 0.4);
+		for (int p = 0; p < GPU_PASS_NUM; p++) {
+			glRasterPos2i(w - 260, 20 + (GPU_PASS_NUM - 1 - p) * 14);
+			snprintf(buffer, sizeof buffer, "%s: %.2f ms GPU, %.2f ms CPU", gpuPassNames[p], gpuTimer.gpuMs[p], gpuTimer.cpuMs[p]);
+			for (bufp = buffer; *bufp; bufp++)
+				glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *bufp);
+		}
+	}
+
+	// average time of each named job, on its own and summed over the threads that ran it
+	if (jobs.timing) {
+		glColor3f(1.0, 1.0, 1.0);
+		for (int k = 0; k < jobs.shownCount; k++) {
+			const jobTimes_t *times = &jobs.shown[k];
+			glRasterPos2i(30, 430 - k * 15);
+			snprintf(buffer, sizeof buffer, "%s: %.2f ms, %.2f ms busy", times->name,
+				times->count ? times->wall / times->count : 0.0, times->count ? times->busy / times->count : 0.0);
+			for (bufp = buffer; *bufp; bufp++)
+				glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *bufp);
+		}
+	}
+
 	if (!global.start) {
 		glColor3f(1.0, 1.0, 0.0);
 		glRasterPos2i(300, 300);
@@ -1501,7 +5963,6 @@ void renderOSD() {
 	}
 
 	if (global.win || global.loose) {
-		global.go = !global.go;
 		glColor3f(1.0, 1.0, 0.0);
 		glRasterPos2i(350, 300);
 		if (global.win)
@@ -1524,10 +5985,54 @@ void renderOSD() {
 	glPopAttrib();
 }
 
+// rebuild only the derived data whose inputs changed since the last call
+void calc() {
+	PROFILE_ZONE("calc");
+	// the meshes of a new tessellation, the island normals and the sea do not depend on each
+	// other. The meshes read this thread's game state and are pinned to it; the island normals
+	// and the sea take what they need from it here and can run on any thread. The normal map
+	// texels come from the wave model the sea brought to the current time
+	job_t *stages[4];
+	int count = 0;
+	if (global.dirty & DIRTY_TESSELLATION) {
+		global.next = (terrain.size - 1) / global.tessellation;
+		global.step = terrain.worldSize / global.tessellation;
+		global.thetaStep = M_PI * 2.0 / global.tessellation;
+		stages[count++] = jobCreate("meshes", [] {
+			calcNormalCylinderSide();
+			calcNormalFort();
+			if (terrainResident())
+				buildIsland();
+			buildSeaIndices();
+			buildCannonball();
+		}, true);
+		int tess = global.tessellation, next = global.next;
+		if (terrainResident())
+			stages[count++] = jobCreate(NULL, [tess, next] { calcNormalIsland(tess, next); }, false);
+	}
+	if (global.dirty & DIRTY_AIM)
+		calcAim();
+	global.dirty = 0;
+	// the simulation thread keeps the sea grid of its snapshots up to date
+	if (!sim.thread) {
+		job_t *sea = stages[count++] = jobCreate("sea", seaGridBuild(), false);
+		stages[count] = jobCreate(NULL, seaNormalMapGenerate, true);
+		jobAfter(stages[count++], sea);
+	}
+	jobGraph(stages, count);
+}
+
 void display() {
 	GLenum error;
+	long long frameStart = clockNs();
+	profileFrameStart();
+	PROFILE_ZONE("frame");
+	gpuTimerFrame();
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	compact.frameUploadBytes = 0;
+	drawCount.batches = drawCount.vertices = 0;
+	glCalls.frames++;
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -1549,6 +6054,7 @@ void display() {
 	glLightfv(GL_LIGHT0, GL_POSITION, light_pos);
 	glPushMatrix();
 
+	simConsume();
 	calc();
 
 	glEnable(GL_TEXTURE_2D);
@@ -1556,7 +6062,12 @@ void display() {
 	glDisable(GL_LIGHTING);
 	glDisable(GL_BLEND);
 	glTranslatef(0.0, 20.0, 0.0);
-	drawSky(50.0f);
+	{
+		PROFILE_ZONE("sky");
+		gpuTimerBegin(GPU_SKY);
+		drawSky(50.0f);
+		gpuTimerEnd();
+	}
 	glTranslatef(0.0, -20.0, 0.0);
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_LIGHTING);
@@ -1566,18 +6077,18 @@ void display() {
 	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, gray);
 	glEnable(GL_TEXTURE_2D);
 	glDisable(GL_BLEND);	
-	renderIsland();
+	{
+		PROFILE_ZONE("islands");
+		gpuTimerBegin(GPU_ISLANDS);
+		renderIslands();
+		gpuTimerEnd();
+	}
 	glEnable(GL_BLEND);
 	glDisable(GL_TEXTURE_2D);
 
 	if (global.start) {
-		int boatHit = checkHit(ball[ISLAND].pv);
-		if (boatHit >= 0 && boatHit != ISLAND) {
-			boat[boatHit].isHit = true;
-			global.score++;
-			if (global.score == MAX_BOAT_NUM)
-				global.win = true;
-		}
+		PROFILE_ZONE("boats");
+		gpuTimerBegin(GPU_BOATS);
 		int boatWillHit = predictHit(finalPointWhenParabolaTouchObject(island));
 		for (int i = 0; i < MAX_BOAT_NUM; i++) {
 			if (!boat[i].isHit) {
@@ -1602,29 +6113,46 @@ void display() {
 				glEnable(GL_LIGHTING);
 			}
 		}
+		gpuTimerEnd();
 	}
 	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, cyan);
 	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, white);
 	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 50.0);
-	drawFort();
-	if (ball[ISLAND].fire) {
-		glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, cyan);
-		glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, white);
-		glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 50.0);
-		glRotatef(-global.rAngleY0 * 180.0 / M_PI, 0.0, 1.0, 0.0);
-		renderCannonball(ISLAND);
-		glRotatef(global.rAngleY0 * 180.0 / M_PI, 0.0, 1.0, 0.0);
+	{
+		PROFILE_ZONE("forts");
+		gpuTimerBegin(GPU_FORTS);
+		drawFort();
+		drawForts();
+		gpuTimerEnd();
 	}
+	{
+		PROFILE_ZONE("trajectories");
+		gpuTimerBegin(GPU_TRAJECTORIES);
+		if (ball[ISLAND].fire) {
+			glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, cyan);
+			glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, white);
+			glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 50.0);
+			glRotatef(-global.rAngleY0 * 180.0 / M_PI, 0.0, 1.0, 0.0);
+			renderCannonball(ISLAND);
+			glRotatef(global.rAngleY0 * 180.0 / M_PI, 0.0, 1.0, 0.0);
+		}
 
-	glDisable(GL_LIGHTING);
-	glRotatef(-global.rAngleY * 180.0 / M_PI, 0.0, 1.0, 0.0);
-	// draw cannon projectile prediction line
-	drawTrajectoryIsland(island);
-	glRotatef(global.rAngleY * 180.0 / M_PI, 0.0, 1.0, 0.0);
-	glEnable(GL_LIGHTING);
+		glDisable(GL_LIGHTING);
+		glRotatef(-global.rAngleY * 180.0 / M_PI, 0.0, 1.0, 0.0);
+		// draw cannon projectile prediction line
+		drawTrajectoryIsland(island);
+		glRotatef(global.rAngleY * 180.0 / M_PI, 0.0, 1.0, 0.0);
+		glEnable(GL_LIGHTING);
+		gpuTimerEnd();
+	}
 
 	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, seaBlue);
-	renderSea();
+	{
+		PROFILE_ZONE("render sea");
+		gpuTimerBegin(GPU_SEA);
+		renderSea();
+		gpuTimerEnd();
+	}
 
 	if (global.wireframeMode) {
 		glDisable(GL_LIGHTING);
@@ -1632,15 +6160,46 @@ void display() {
 		drawNormal();
 	}
 
-	renderOSD();
+	if (!offscreen.benchmarking) {
+		PROFILE_ZONE("osd");
+		gpuTimerBegin(GPU_OSD);
+		renderOSD();
+		gpuTimerEnd();
+	}
 
 	glPopMatrix();
 	global.frames++;
-	glutSwapBuffers();
+	{
+		PROFILE_ZONE("swap");
+		if (offscreen.benchmarking)
+			glFinish();
+		else
+			glutSwapBuffers();
+	}
+
+	// frame rate
+	stopwatchStop(STOPWATCH_RENDER, frameStart);
+	metricsFrame(frameStart);
+	float t = clockSeconds(), dt = t - global.lastFrameRateT;
+	if (dt > global.frameRateInterval) {
+		profileTake(global.frames);
+		gpuTimerTake(global.frames);
+		timing.simMs = stopwatchTake(STOPWATCH_SIM);
+		timing.renderMs = stopwatchTake(STOPWATCH_RENDER);
+		if (jobs.timing)
+			jobs.shownCount = jobStatsTake(jobs.shown);
+		double cpu = pacerCpu();
+		pacer.cpuMs = (cpu - pacer.lastCpu) * MILLI / global.frames;
+		pacer.lastCpu = cpu;
+		global.frameRate = global.frames / dt;
+		global.lastFrameRateT = t;
+		global.frames = 0;
+	}
 
 	/* check OpenGL error */
 	while ((error = glGetError()) != GL_NO_ERROR)
 		printf("%s\n", gluErrorString(error));
+	profileFrame();
 }
 
 void mouse(int button, int state, int x, int y) {
@@ -1684,60 +6243,125 @@ void mouseMotion(int x, int y) {
 	glutPostRedisplay();
 }
 
-void keyboard(unsigned char key, int x, int y) {
-	if (key == ESC)
-		exit(EXIT_SUCCESS);
-	else if(!global.win && !global.loose) {
-		if (!global.start) {
-			global.start = true;
-			global.go = !global.go;
-			global.startTime = glutGet(GLUT_ELAPSED_TIME) / MILLI;
-			initialBoats();
-		} else {
-			switch (key) {
-			case 'g':
-				global.go = !global.go;
-				if (!global.go)
-					global.stopTime = glutGet(GLUT_ELAPSED_TIME) / MILLI;
-				else {
-					global.resumeTime = glutGet(GLUT_ELAPSED_TIME) / MILLI;
-					global.pauseIntervel += global.resumeTime - global.stopTime;
-				}
-			case 'w':
-				if (global.rAngle < M_PI)
-					global.rAngle += M_PI / 180.0;
-				break;
-			case 's':
-				if (global.rAngle > 0)
-					global.rAngle -= M_PI / 180.0;
-				break;
-			case 'a':
-				global.rAngleY -= M_PI / 60.0;
-				break;
-			case 'd':
-				global.rAngleY += M_PI / 60.0;
-				break;
-			case '=':
-				if (global.tessellation < MAX_TESSELLATION)
-					global.tessellation *= 2;
-				break;
-			case '-':
-				if (global.tessellation > MIN_TESSELLATION)
-					global.tessellation /= 2;
-				break;
-			case SPACEBAR: // island fire
-				if (!ball[ISLAND].fire) {
-					ball[ISLAND].fire = true;
-					ball[ISLAND].pv.p = { ISLAND_BALL_X, ISLAND_BALL_Y, ISLAND_BALL_Z };
-					ball[ISLAND].pv.v = { ISLAND_BALL_VX, ISLAND_BALL_VY, ISLAND_BALL_VZ };
-					// save the rotation angle Y of fort when cannonball fires as a saperate value for calculating if cannonball hit boat
-					global.rAngleY0 = global.rAngleY;
+// start the game on the first key
+void startGame() {
+	global.start = true;
+	global.go = !global.go;
+	gameClockStart(&global.gameClock);
+	initialBoats();
+}
+
+// keys that change how the scene is drawn rather than the game; true if key was one
+bool keyboardView(unsigned char key) {
+	switch (key) {
+	case 'n': // switch normal mapped sea with a coarse grid
+		if (sim.thread)
+			printf("The sea grid resolution cannot change while the simulation thread runs.\n");
+		else
+			seaNormalMapEnable(!seaNormalMap.enabled);
+		return true;
+	case 'l': // switch quadtree terrain level of detail; paged terrain has nothing else
+		if (terrainResident() && (terrainLod.patches || terrainLodInit()))
+			terrainLod.enabled = !terrainLod.enabled;
+		return true;
+	case 'v': // switch between float and compact sea and island vertices
+		if (compact.program || compactInit())
+			compact.enabled = !compact.enabled;
+		return true;
+	case 'p': // write the last frames of the profiler as a Chrome trace
+		profileDump();
+		return true;
+	case 'm': // switch wave model
+		if (sim.thread) {
+			printf("The wave model cannot change while the simulation thread runs.\n");
+			return true;
+		}
+		for (int m = 0; m < WAVE_MODEL_NUM; m++) {
+			if (waveModels[m] == waveModel) {
+				waveModel_t *nextModel = waveModels[(m + 1) % WAVE_MODEL_NUM];
+				if (nextModel->init()) {
+					waveModel = nextModel;
+					global.waveVersion++;
 				}
 				break;
-			default:
-				break;
 			}
 		}
+		return true;
+	}
+	return false;
+}
+
+// apply a game key, SIM_KEY_SPECIAL marking GLUT special keys, on the thread that runs the game
+void keyboardGame(int key) {
+	if (global.win || global.loose)
+		return;
+	if (!global.start) {
+		startGame();
+		return;
+	}
+	switch (key) {
+	case 'g':
+		global.go = !global.go;
+		if (!global.go)
+			gameClockPause(&global.gameClock);
+		else
+			gameClockResume(&global.gameClock);
+	case 'w':
+	case SIM_KEY_SPECIAL | GLUT_KEY_UP:
+		if (global.rAngle < M_PI)
+			global.rAngle += M_PI / 180.0;
+		global.dirty |= DIRTY_AIM;
+		break;
+	case 's':
+	case SIM_KEY_SPECIAL | GLUT_KEY_DOWN:
+		if (global.rAngle > 0)
+			global.rAngle -= M_PI / 180.0;
+		global.dirty |= DIRTY_AIM;
+		break;
+	case 'a':
+	case SIM_KEY_SPECIAL | GLUT_KEY_LEFT:
+		global.rAngleY -= M_PI / 60.0;
+		break;
+	case 'd':
+	case SIM_KEY_SPECIAL | GLUT_KEY_RIGHT:
+		global.rAngleY += M_PI / 60.0;
+		break;
+	case '=':
+		if (global.tessellation < MAX_TESSELLATION)
+			global.tessellation *= 2;
+		global.dirty |= DIRTY_TESSELLATION;
+		break;
+	case '-':
+		if (global.tessellation > MIN_TESSELLATION)
+			global.tessellation /= 2;
+		global.dirty |= DIRTY_TESSELLATION;
+		break;
+	case SPACEBAR: // island fire
+		if (!ball[ISLAND].fire) {
+			ball[ISLAND].fire = true;
+			ball[ISLAND].pv.p = { ISLAND_BALL_X, ISLAND_BALL_Y, ISLAND_BALL_Z };
+			ball[ISLAND].pv.v = { ISLAND_BALL_VX, ISLAND_BALL_VY, ISLAND_BALL_VZ };
+			// save the rotation angle Y of fort when cannonball fires as a saperate value for calculating if cannonball hit boat
+			global.rAngleY0 = global.rAngleY;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void keyboard(unsigned char key, int x, int y) {
+	if (key == ESC) {
+		simStop();
+		if (profiler.dumpOnExit)
+			profileDump();
+		metricsClose();
+		glCallsReport();
+		exit(EXIT_SUCCESS);
+	}
+	else if(!global.win && !global.loose) {
+		if (!global.start || !keyboardView(key))
+			simKey(key);
 		glutPostRedisplay();
 	}
 }
@@ -1746,41 +6370,16 @@ void specialKey(int key, int x, int y) {
 	if (key == GLUT_KEY_F1)
 		global.wireframeMode = !global.wireframeMode;
 	else if (!global.win && !global.loose) {
-		if (!global.start) {
-			global.start = true;
-			global.go = !global.go;
-			global.startTime = glutGet(GLUT_ELAPSED_TIME) / MILLI;
-			initialBoats();
-		}
-		else {
-			switch (key) {
-			case GLUT_KEY_UP:
-				if (global.rAngle < M_PI)
-					global.rAngle += M_PI / 180.0;
-				break;
-			case GLUT_KEY_DOWN:
-				if (global.rAngle > 0)
-					global.rAngle -= M_PI / 180.0;
-				break;
-			case GLUT_KEY_LEFT:
-				global.rAngleY -= M_PI / 60.0;
-				break;
-			case GLUT_KEY_RIGHT:
-				global.rAngleY += M_PI / 60.0;
-				break;
-			default:
-				break;
-			}
-		}
+		simKey(SIM_KEY_SPECIAL | key);
 		glutPostRedisplay();
 	}
 }
 
-bool init() {
-	glClearColor(0.0, 0.0, 0.0, 0.0);
-	glShadeModel(GL_SMOOTH);
+// the game state that needs no GL
+bool gameInit() {
+	global.boatStopR = calcDistanceBoatHitIsland() - 2.0 * FORT_R - FORT_BASE_H;
 
-	srand((unsigned)time(0));
+	srand(randomSeed ? randomSeed : (unsigned)time(0));
 	for (int i = 0; i < MAX_BOAT_NUM; i++) {
 		for (int k = 0; k < PARTICLE_NUM; k++) {
 			particle[i][k].p.y = -100000.0;
@@ -1792,6 +6391,34 @@ bool init() {
 			particle[i][k].v.z = v * cosf(angleX) * cosf(angleY);
 		}
 	}
+	return true;
+}
+
+bool init() {
+#if _WIN32
+	glewInit();
+#endif
+	gridRestartInit();
+	glClearColor(0.0, 0.0, 0.0, 0.0);
+	glShadeModel(GL_SMOOTH);
+	if (compact.enabled)
+		compactInit();
+	if (seaNormalMap.enabled)
+		seaNormalMapEnable(true);
+	// heightmaps larger than the built in island need level of detail, paged terrain can only use it
+	if (terrain.size > ISLAND_SIZE || !terrainResident())
+		terrainLod.enabled = true;
+	if (terrainLod.enabled && !terrainLodInit()) {
+		if (!terrainResident())
+			return false;
+		terrainLod.enabled = false;
+	}
+	if (world.count > 1 && !fortMeshInit())
+		return false;
+	if (gpuTimer.enabled)
+		gpuTimerInit();
+	if (!gameInit())
+		return false;
 
 	glGenTextures(1, &textureTerrian);
 	textureTerrian = loadTexture("terrian.jpg");
@@ -1823,7 +6450,634 @@ void reshape(int w, int h) {
 	glMatrixMode(GL_MODELVIEW);
 }
 
+typedef struct {
+	int waveFrames; // --bench-waves
+	int seaShadingFrames; // --bench-sea-shading
+	bool indices; // --bench-indices
+	int rayCasts; // --bench-ray-casts
+	bool terrainNoise; // --bench-terrain-noise
+	bool terrainLayout; // --bench-terrain-layout
+	int jobFrames; // --bench-jobs
+	int renderFrames; // --bench-render
+	const char *renderFilename; // --bench-render-out
+} bench_t;
+
+bench_t bench = { 0, 0, false, 0, false, false, 0, 0, "bench_render.csv" };
+
+// cost per frame of building an (n + 1) x (n + 1) sea grid with heights and normals from each wave model
+void benchWaves(int frames) {
+	static const int sizes[] = { 32, 64, 128, 256 };
+	int oceanN = ocean.n;
+	float oceanRate = ocean.updateRate;
+	volatile float sink = 0.0f;
+	printf("grid\tmodel\tms/frame\n");
+	for (unsigned s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+		int n = sizes[s];
+		oceanFree();
+		ocean.n = n;
+		ocean.updateRate = 0.0f; // matched work: every frame is a new FFT
+		for (int m = 0; m < WAVE_MODEL_NUM; m++) {
+			waveModel_t *model = waveModels[m];
+			if (!model->init())
+				continue;
+			float step = RANGE_SEA / n;
+			double start = clockSeconds();
+			for (int f = 0; f < frames; f++) {
+				float t = f * 0.016f;
+				model->update(t);
+				for (int j = 0; j <= n; j++) {
+					for (int i = 0; i <= n; i++) {
+						float y, dydx, dydz, dy;
+						model->sample(-RANGE_SEA / 2.0 + i * step, -RANGE_SEA / 2.0 + j * step, t, &y, true, &dydx, &dydz, &dy);
+						sink = sink + y + dy;
+					}
+				}
+			}
+			double ms = (clockSeconds() - start) * MILLI / frames;
+			printf("%d\t%s\t%.3f\n", n + 1, model->name, ms);
+		}
+	}
+	oceanFree();
+	ocean.n = oceanN;
+	ocean.updateRate = oceanRate;
+}
+
+// frame time of the whole scene with per vertex sea normals and with the normal mapped coarse sea
+void benchSeaShading(int frames) {
+	printf("tessellation\tsea\tsea vertices\tms/frame\n");
+	for (int tess = MIN_TESSELLATION; tess <= MAX_TESSELLATION; tess *= 2) {
+		for (int mode = 0; mode < 2; mode++) {
+			seaNormalMapEnable(mode == 1);
+			if (mode == 1 && !seaNormalMap.enabled)
+				continue;
+			global.tessellation = tess;
+			global.dirty |= DIRTY_TESSELLATION;
+			display(); // warm up and build the buffers for this tessellation
+			glFinish();
+			double start = clockSeconds();
+			for (int f = 0; f < frames; f++) {
+				global.t += 0.016f;
+				display();
+			}
+			glFinish();
+			double ms = (clockSeconds() - start) * MILLI / frames;
+			printf("%d\t%s\t%d\t%.3f\n", tess, mode ? "normal map" : "vertex normals", (seaGridTess() + 1) * (seaGridTess() + 1), ms);
+		}
+	}
+}
+
+// average cache miss ratio of each index layout on the island grids and the terrain patch
+void benchIndices() {
+	static const int caches[] = { 8, 16, 32 };
+	static GLuint indices[GRID_INDICES_MAX(MAX_TESSELLATION * 2, MAX_TESSELLATION * 2)];
+	printf("grid\tlayout\tindices");
+	for (unsigned c = 0; c < sizeof caches / sizeof caches[0]; c++)
+		printf("\tacmr %d", caches[c]);
+	printf("\n");
+	for (int tess = MIN_TESSELLATION; tess <= MAX_TESSELLATION * 2; tess *= 2) {
+		// the last grid is a terrain patch with its skirt ring
+		int n = tess > MAX_TESSELLATION ? TERRAIN_PATCH_VERTICES : tess + 1;
+		for (int layout = 0; layout < INDEX_LAYOUT_NUM; layout++) {
+			int count = gridIndices(n, n, layout, indices, sizeof indices / sizeof indices[0]);
+			printf("%d\t%s\t%d", n, indexLayoutNames[layout], count);
+			for (unsigned c = 0; c < sizeof caches / sizeof caches[0]; c++)
+				printf("\t%.3f", gridAcmr(indices, count, indexStrips(layout), caches[c]));
+			printf("\n");
+		}
+	}
+}
+
+// cannonball flights over the terrain found by sampling every 35 ms and by casting each step
+void benchRayCasts(int flights) {
+	std::vector<vec6f> starts(flights);
+	srand(1);
+	for (int f = 0; f < flights; f++) {
+		float a = rand() * 2.0f * M_PI / RAND_MAX, elevation = rand() * 1.2f / RAND_MAX;
+		vec3f p = { (rand() / (float)RAND_MAX - 0.5f) * terrain.worldSize, 0.0f, (rand() / (float)RAND_MAX - 0.5f) * terrain.worldSize };
+		p.y = calcHeightTerrain(p) + 0.5f;
+		starts[f].p = p;
+		starts[f].v = { CANNON_SPEED * cosf(elevation) * sinf(a), CANNON_SPEED * sinf(elevation), CANNON_SPEED * cosf(elevation) * cosf(a) };
+	}
+	std::vector<vec6f> sampled(flights);
+	double start = clockSeconds();
+	for (int f = 0; f < flights; f++) {
+		vec6f pv = starts[f];
+		do {
+			pv = calcParabola(pv, 0.035);
+		} while (pv.p.y > calcHeightTerrain(pv.p));
+		sampled[f] = pv;
+	}
+	double sampleMs = (clockSeconds() - start) * MILLI;
+	terrainCasts = terrainCastNodes = 0;
+	int early = 0;
+	double cells = 0.0; // cells a walk from cell to cell would visit instead
+	start = clockSeconds();
+	for (int f = 0; f < flights; f++) {
+		vec6f pv = starts[f];
+		float t;
+		for (;;) {
+			vec6f next = calcParabola(pv, 0.035);
+			cells += (fabsf(next.p.x - pv.p.x) + fabsf(next.p.z - pv.p.z)) * (terrain.size - 1) / terrain.worldSize + 1.0;
+			if (terrainCast(pv.p, next.p, &t)) {
+				// the sampled flight went on through the terrain past this step
+				early += sampled[f].v.y < next.v.y - 1e-4f;
+				break;
+			}
+			pv = next;
+			if (pv.p.y <= calcHeightTerrain(pv.p))
+				break;
+		}
+	}
+	double castMs = (clockSeconds() - start) * MILLI;
+	printf("terrain %d x %d, %d flights\n", terrain.size, terrain.size, flights);
+	printf("sampled\t%.3f us/flight\n", sampleMs * MILLI / flights);
+	printf("cast\t%.3f us/flight\t%.3f us/cast\t%.1f blocks/cast (%.1f cells)\t%d flights hit earlier\n", castMs * MILLI / flights,
+		castMs * MILLI / terrainCasts, float(terrainCastNodes) / terrainCasts, cells / terrainCasts, early);
+}
+
+// time generating noise islands of several sizes with and without SSE2
+void benchTerrainNoise() {
+	static const int sizes[] = { 513, 1025, 2049, 4097 };
+	printf("%s noise, %d octaves, %u threads\n", noiseTypeNames[terrainNoise.type], terrainNoise.octaves, std::thread::hardware_concurrency());
+	printf("size\tscalar ms\tsimd ms\tMsamples/s\n");
+	for (int s = 0; s < 4; s++) {
+		terrainNoise.size = sizes[s];
+		double start = clockSeconds();
+		if (!terrainNoiseBuild(false))
+			return;
+		double scalarMs = (clockSeconds() - start) * MILLI;
+		start = clockSeconds();
+		terrainNoiseBuild(true);
+		double simdMs = (clockSeconds() - start) * MILLI;
+		printf("%d\t%.1f\t\t%.1f\t%.1f\n", terrain.size, scalarMs, simdMs, (double)terrain.size * terrain.size / simdMs / MILLI);
+	}
+}
+
+// sum of the 3 x 3 samples around (i, j), read a row at a time like the normals and patches
+float benchTerrainNeighbourhood(int i, int j) {
+	float sum = 0.0f;
+	GLfloat scratch[3];
+	for (int b = -1; b <= 1; b++) {
+		const GLfloat *row = terrainSamples(j + b, i - 1, 3, scratch);
+		sum += row[0] + row[1] + row[2];
+	}
+	return sum;
+}
+
+// random 3 x 3 neighbourhoods, as around cannonball impacts, and sweeps of them over the whole
+// map in row order and tile by tile, over noise islands of several sizes in each terrain layout
+void benchTerrainLayout() {
+	static const int sizes[] = { 1025, 4097, 8193 };
+	const int queries = 1 << 21;
+	printf("%s samples, %d random neighbourhoods per layout, Mneighbourhoods/s\n", terrain.quantise ? "quantised" : "float", queries);
+	printf("size\tlayout\trandom\trow sweep\ttile sweep\tchecksum\n");
+	std::vector<int> samples(2 * (size_t)queries);
+	for (int s = 0; s < 3; s++) {
+		terrainNoise.size = sizes[s];
+		// the same samples for every layout
+		unsigned x = 2463534242u;
+		for (int q = 0; q < 2 * queries; q++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			samples[q] = (int)(x % (unsigned)terrainSizeFor(sizes[s]));
+		}
+		for (int layout = 0; layout < TERRAIN_LAYOUT_NUM; layout++) {
+			if (terrain.quantise && layout == TERRAIN_ROWS)
+				continue;
+			terrain.layout = layout;
+			if (!terrainNoiseBuild(true))
+				return;
+			int n = terrain.size;
+			double sum = 0.0, start = clockSeconds();
+			for (int q = 0; q < queries; q++)
+				sum += benchTerrainNeighbourhood(samples[2 * q], samples[2 * q + 1]);
+			double randomSeconds = clockSeconds() - start;
+			start = clockSeconds();
+			for (int j = 0; j < n; j++)
+				for (int i = 0; i < n; i++)
+					sum += benchTerrainNeighbourhood(i, j);
+			double rowSeconds = clockSeconds() - start;
+			start = clockSeconds();
+			for (int tz = 0; tz < n; tz += TERRAIN_TILE)
+				for (int tx = 0; tx < n; tx += TERRAIN_TILE)
+					for (int j = tz; j < tz + TERRAIN_TILE && j < n; j++)
+						for (int i = tx; i < tx + TERRAIN_TILE && i < n; i++)
+							sum += benchTerrainNeighbourhood(i, j);
+			double tileSeconds = clockSeconds() - start;
+			double sweep = (double)n * n / 1e6;
+			printf("%d\t%s\t%.1f\t%.1f\t\t%.1f\t\t%.6g\n", n, terrainLayoutNames[layout], queries / randomSeconds / 1e6,
+				sweep / rowSeconds, sweep / tileSeconds, sum);
+		}
+	}
+}
+
+// time per frame of the CPU stages of a frame and a tick, run on the calling thread alone and
+// as jobs spread over the workers
+void benchJobs(int frames) {
+	jobTimes_t times[2][JOB_STATS];
+	int counts[2];
+	double total[2];
+	GLubyte *texels = (GLubyte *)malloc(seaNormalMap.size * seaNormalMap.size * 3);
+	int workers = jobs.workers;
+	global.tessellation = MAX_TESSELLATION;
+	global.next = (terrain.size - 1) / global.tessellation;
+	for (int mode = 0; mode < 2; mode++) {
+		// jobFor() runs every range on the calling thread without workers
+		jobs.workers = mode ? workers : 0;
+		jobStatsTake(times[mode]);
+		double start = clockSeconds();
+		for (int f = 0; f < frames; f++) {
+			global.t += 0.016f;
+			seaGridUpdate();
+			seaNormalMapTexels(texels);
+			if (terrainResident())
+				calcNormalIsland(global.tessellation, global.next);
+		}
+		total[mode] = (clockSeconds() - start) * MILLI / frames;
+		counts[mode] = jobStatsTake(times[mode]);
+	}
+	jobs.workers = workers;
+	free(texels);
+	printf("%s waves, sea grid %d x %d, %d workers\n", waveModel->name, seaGridTess() + 1, seaGridTess() + 1, workers);
+	printf("stage\tserial ms/frame\tjobs ms/frame\tjobs busy ms/frame\n");
+	for (int k = 0; k < counts[1]; k++) {
+		double serial = 0.0;
+		for (int m = 0; m < counts[0]; m++)
+			if (times[0][m].name == times[1][k].name)
+				serial = times[0][m].wall / frames;
+		printf("%s\t%.3f\t%.3f\t%.3f\n", times[1][k].name, serial, times[1][k].wall / frames, times[1][k].busy / frames);
+	}
+	printf("total\t%.3f\t%.3f\n", total[0], total[1]);
+}
+
+/************************************************************************************************
+ * Headless
+ *
+ * --headless plays the game with no window or GL context and prints how it went, for
+ * simulation throughput tests on machines without a display. The game runs on the main thread
+ * as fast as it can: each tick moves the game clock on by --time-step, 1/60 s unless given,
+ * until the game is won or lost or --ticks ticks or --seconds game seconds have passed.
+ *
+ * Nobody is at the keys, so the fort aims itself through the same keys a player would press:
+ * it turns towards the nearest boat, raises or lowers the cannon until the shot lands at the
+ * boat's range, and fires when the aim line says the shot will hit.
+ *************************************************************************************************/
+#define HEADLESS_STEP (1.0 / 60.0)
+
+typedef struct {
+	bool enabled; // --headless
+	long ticks; // --ticks, 0 for no limit
+	float seconds; // --seconds of game time, 0 for no limit
+	int shots; // island cannonballs fired
+} headless_t;
+
+headless_t headless = { false, 0, 0.0f, 0 };
+
+// the keys a player would press this tick to hit the nearest boat
+void headlessAim() {
+	int target = -1;
+	float r = 0.0f;
+	for (int i = 0; i < MAX_BOAT_NUM; i++) {
+		float d = sqrtf(boat[i].p.x * boat[i].p.x + boat[i].p.z * boat[i].p.z);
+		if (!boat[i].isHit && (target < 0 || d < r)) {
+			target = i;
+			r = d;
+		}
+	}
+	if (target < 0)
+		return;
+	vec6f landing = finalPointWhenParabolaTouchObject(island);
+	if (!ball[ISLAND].fire && predictHit(landing) >= 0) {
+		keyboardGame(SPACEBAR);
+		headless.shots++;
+		return;
+	}
+	// predictHit() wants atan2(x, z) + M_PI + rAngleY to be a whole turn
+	float turn = fmodf(-(atan2f(boat[target].p.x, boat[target].p.z) + M_PI) - global.rAngleY, 2.0 * M_PI);
+	turn = turn > M_PI ? turn - 2.0 * M_PI : turn < -M_PI ? turn + 2.0 * M_PI : turn;
+	if (fabsf(turn) > M_PI / 120.0)
+		keyboardGame(turn > 0.0f ? 'd' : 'a');
+	// the range grows with the cannon angle up to 45 degrees
+	float range = -landing.p.z;
+	if (range < r - BOAT_L / 2.0 && global.rAngle < M_PI / 4.0)
+		keyboardGame('w');
+	else if (range > r + BOAT_L / 2.0)
+		keyboardGame('s');
+}
+
+bool headlessRun() {
+	if (!gameInit())
+		return false;
+	if (timing.step <= 0.0)
+		timing.step = HEADLESS_STEP;
+	seaGridUpdate();
+	calcAim();
+	startGame();
+	long ticks = 0;
+	long long start = clockNs();
+	while (!global.win && !global.loose && (!headless.ticks || ticks < headless.ticks)
+		&& (headless.seconds <= 0.0f || global.t < headless.seconds)) {
+		headlessAim();
+		if (global.dirty & DIRTY_AIM)
+			calcAim();
+		global.dirty = 0;
+		if (simTick())
+			ticks++;
+	}
+	double wall = (clockNs() - start) * 1e-9;
+	printf("%ld ticks, %.1f game seconds in %.2f s: %.0f ticks/s, %.2f ms per tick\n", ticks, global.t, wall,
+		wall > 0.0 ? ticks / wall : 0.0, ticks ? wall * MILLI / ticks : 0.0);
+	printf("%d shots, %d of %d boats sunk, %d ticks of island damage, score %d\n", headless.shots, global.score,
+		MAX_BOAT_NUM, global.islandHitCount, global.score);
+	printf("%s\n", global.win ? "won" : global.loose ? "lost" : "undecided");
+	return true;
+}
+
+#define BENCH_RENDER_WARMUP 10 // frames drawn at each tessellation before timing
+#define BENCH_RENDER_SEED 1 // --seed of the render benchmark when none is given
+
+// the scripted camera at u along the path, 0 to 1: one orbit of the island, closing in and
+// pulling back twice and rising and falling once
+void benchRenderCamera(float u) {
+	camera.rAngleY = 2.0 * M_PI * u;
+	camera.x = 4.0f * sinf(4.0 * M_PI * u);
+	camera.y = 3.0f * sinf(2.0 * M_PI * u);
+	camera.destY = -sinf(2.0 * M_PI * u);
+}
+
+// frame time percentiles at each tessellation of the same seeded game, as the fort plays it,
+// seen along the same camera path; written to bench.renderFilename as CSV with the seed, so
+// runs can be compared
+bool benchRender(int frames) {
+	FILE *f = fopen(bench.renderFilename, "w");
+	if (!f) {
+		printf("Failed to write %s.\n", bench.renderFilename);
+		return false;
+	}
+	fprintf(f, "seed,tessellation,frames,mean_ms,p50_ms,p90_ms,p95_ms,p99_ms,max_ms,batches,vertices\n");
+	printf("seed %u\n", randomSeed);
+	printf("tessellation\tmean ms\tp50 ms\tp90 ms\tp95 ms\tp99 ms\tmax ms\tbatches\tvertices\n");
+	offscreen.benchmarking = true;
+	if (timing.step <= 0.0)
+		timing.step = HEADLESS_STEP;
+	reshape(WIDTH, HEIGHT);
+	seaGridUpdate();
+	calcAim();
+	startGame();
+	simSnapshot_t *start = new simSnapshot_t();
+	simSave(start);
+	std::vector<double> ms(frames);
+	for (int tess = MIN_TESSELLATION; tess <= MAX_TESSELLATION; tess *= 2) {
+		simLoad(start);
+		global.tessellation = tess;
+		global.dirty |= DIRTY_ALL;
+		long batches = 0, vertices = 0;
+		for (int k = -BENCH_RENDER_WARMUP; k < frames; k++) {
+			benchRenderCamera(k < 0 ? 0.0f : float(k) / frames);
+			headlessAim();
+			simTick();
+			long long frameStart = clockNs();
+			display();
+			if (k < 0)
+				continue;
+			ms[k] = (clockNs() - frameStart) * 1e-6;
+			batches += drawCount.batches;
+			vertices += drawCount.vertices;
+		}
+		qsort(ms.data(), frames, sizeof(double), compareDouble);
+		double sum = 0.0;
+		for (int k = 0; k < frames; k++)
+			sum += ms[k];
+		double p[5] = { percentile(ms, 0.5), percentile(ms, 0.9), percentile(ms, 0.95), percentile(ms, 0.99), ms[frames - 1] };
+		fprintf(f, "%u,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%ld,%ld\n", randomSeed, tess, frames, sum / frames,
+			p[0], p[1], p[2], p[3], p[4], batches / frames, vertices / frames);
+		printf("%d\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%ld\t%ld\n", tess, sum / frames,
+			p[0], p[1], p[2], p[3], p[4], batches / frames, vertices / frames);
+	}
+	delete start;
+	fclose(f);
+	printf("Wrote %s.\n", bench.renderFilename);
+	return true;
+}
+
+// parse command line options; returns false on a bad option
+bool parseArgs(int argc, char **argv) {
+	for (int i = 1; i < argc; i++) {
+		bool hasValue = i + 1 < argc;
+		if (!strcmp(argv[i], "--wave") && hasValue) {
+			const char *name = argv[++i];
+			waveModel = NULL;
+			for (int m = 0; m < WAVE_MODEL_NUM; m++)
+				if (!strcmp(waveModels[m]->name, name))
+					waveModel = waveModels[m];
+			if (!waveModel) {
+				printf("Unknown wave model '%s'.\n", name);
+				return false;
+			}
+		} else if (!strcmp(argv[i], "--ocean-n") && hasValue) {
+			ocean.n = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--ocean-size") && hasValue) {
+			ocean.size = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--ocean-rate") && hasValue) {
+			ocean.updateRate = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--ocean-seed") && hasValue) {
+			ocean.seed = (unsigned)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--sea-normal-map")) {
+			seaNormalMap.enabled = true;
+			if (hasValue && atoi(argv[i + 1]) > 0)
+				seaNormalMap.coarseness = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--normal-map-size") && hasValue) {
+			seaNormalMap.size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--terrain") && hasValue) {
+			terrain.filename = argv[++i];
+		} else if (!strcmp(argv[i], "--terrain-size") && hasValue) {
+			terrain.worldSize = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--terrain-height") && hasValue) {
+			terrain.heightScale = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--terrain-quantise")) {
+			terrain.quantise = true;
+		} else if (!strcmp(argv[i], "--terrain-layout") && hasValue) {
+			const char *name = argv[++i];
+			terrain.layout = -1;
+			for (int l = 0; l < TERRAIN_LAYOUT_NUM; l++)
+				if (!strcmp(terrainLayoutNames[l], name))
+					terrain.layout = l;
+			if (terrain.layout < 0) {
+				printf("Unknown terrain layout '%s'.\n", name);
+				return false;
+			}
+		} else if (!strcmp(argv[i], "--bench-terrain-layout")) {
+			bench.terrainLayout = true;
+		} else if (!strcmp(argv[i], "--terrain-noise") && hasValue) {
+			terrainNoise.size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--terrain-noise-type") && hasValue) {
+			const char *name = argv[++i];
+			terrainNoise.type = -1;
+			for (int t = 0; t < NOISE_TYPE_NUM; t++)
+				if (!strcmp(noiseTypeNames[t], name))
+					terrainNoise.type = t;
+			if (terrainNoise.type < 0) {
+				printf("Unknown noise type '%s'.\n", name);
+				return false;
+			}
+		} else if (!strcmp(argv[i], "--terrain-seed") && hasValue) {
+			terrainNoise.seed = (unsigned)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--terrain-octaves") && hasValue) {
+			terrainNoise.octaves = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--bench-terrain-noise")) {
+			bench.terrainNoise = true;
+		} else if (!strcmp(argv[i], "--terrain-lod")) {
+			terrainLod.enabled = true;
+			if (hasValue && atof(argv[i + 1]) > 0.0f)
+				terrainLod.tau = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--terrain-patches") && hasValue) {
+			terrainLod.maxPatches = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--terrain-pages") && hasValue) {
+			terrainPager.filename = argv[++i];
+		} else if (!strcmp(argv[i], "--terrain-budget") && hasValue) {
+			terrainPager.budget = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--bake-terrain-pages") && hasValue) {
+			terrainPager.bakeFilename = argv[++i];
+		} else if (!strcmp(argv[i], "--sim-thread")) {
+			sim.enabled = true;
+		} else if (!strcmp(argv[i], "--sim-rate") && hasValue) {
+			sim.rate = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--time-scale") && hasValue) {
+			timing.scale = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--time-step") && hasValue) {
+			timing.step = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--metrics") && hasValue) {
+			metrics.filename = argv[++i];
+		} else if (!strcmp(argv[i], "--metrics-summary") && hasValue) {
+			metrics.summaryFilename = argv[++i];
+		} else if (!strcmp(argv[i], "--seed") && hasValue) {
+			randomSeed = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "--bench-render")) {
+			bench.renderFrames = 300;
+			if (hasValue && atoi(argv[i + 1]) > 0)
+				bench.renderFrames = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--bench-render-out") && hasValue) {
+			bench.renderFilename = argv[++i];
+		} else if (!strcmp(argv[i], "--headless")) {
+			headless.enabled = true;
+		} else if (!strcmp(argv[i], "--ticks") && hasValue) {
+			headless.ticks = atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--seconds") && hasValue) {
+			headless.seconds = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--gl-calls")) {
+			glCalls.enabled = true;
+		} else if (!strcmp(argv[i], "--gpu-timing")) {
+			gpuTimer.enabled = true;
+			if (hasValue && !strcmp(argv[i + 1], "finish")) {
+				gpuTimer.finish = true;
+				i++;
+			}
+		} else if (!strcmp(argv[i], "--profile")) {
+			profiler.enabled = true;
+		} else if (!strcmp(argv[i], "--profile-dump") && hasValue) {
+			profiler.enabled = true;
+			profiler.dumpOnExit = true;
+			profiler.dumpFilename = argv[++i];
+		} else if (!strcmp(argv[i], "--profile-frames") && hasValue) {
+			profiler.dumpFrames = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--fps") && hasValue) {
+			pacer.fps = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--jobs") && hasValue) {
+			jobs.workers = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--job-timing")) {
+			jobs.timing = true;
+		} else if (!strcmp(argv[i], "--bench-jobs")) {
+			bench.jobFrames = 100;
+			if (hasValue && atoi(argv[i + 1]) > 0)
+				bench.jobFrames = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--islands") && hasValue) {
+			world.count = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--island-seed") && hasValue) {
+			world.seed = (unsigned)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--index-layout") && hasValue) {
+			const char *name = argv[++i];
+			indexLayout.layout = -1;
+			for (int l = 0; l < INDEX_LAYOUT_NUM; l++)
+				if (!strcmp(indexLayoutNames[l], name))
+					indexLayout.layout = l;
+			if (indexLayout.layout < 0) {
+				printf("Unknown index layout '%s'.\n", name);
+				return false;
+			}
+		} else if (!strcmp(argv[i], "--bench-indices")) {
+			bench.indices = true;
+		} else if (!strcmp(argv[i], "--bench-ray-casts")) {
+			bench.rayCasts = 10000;
+			if (hasValue && atoi(argv[i + 1]) > 0)
+				bench.rayCasts = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--compact-vertices")) {
+			compact.enabled = true;
+		} else if (!strcmp(argv[i], "--bench-waves")) {
+			bench.waveFrames = 100;
+			if (hasValue && atoi(argv[i + 1]) > 0)
+				bench.waveFrames = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--bench-sea-shading")) {
+			bench.seaShadingFrames = 100;
+			if (hasValue && atoi(argv[i + 1]) > 0)
+				bench.seaShadingFrames = atoi(argv[++i]);
+		}
+	}
+	// the render benchmark plays the same game on every run unless told otherwise
+	if (bench.renderFrames > 0 && !randomSeed)
+		randomSeed = BENCH_RENDER_SEED;
+	return true;
+}
+
 int main(int argc, char **argv) {
+	if (!parseArgs(argc, argv))
+		return EXIT_FAILURE;
+#if PROFILER
+	// the main thread records into the first ring
+	if (profiler.enabled)
+		profileRing();
+#endif
+	jobInit();
+	if (metrics.summaryFilename)
+		return metricsSummary(metrics.summaryFilename) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (bench.waveFrames > 0) {
+		benchWaves(bench.waveFrames);
+		return EXIT_SUCCESS;
+	}
+	if (bench.indices) {
+		benchIndices();
+		return EXIT_SUCCESS;
+	}
+	if (bench.terrainNoise) {
+		benchTerrainNoise();
+		return EXIT_SUCCESS;
+	}
+	if (bench.terrainLayout) {
+		benchTerrainLayout();
+		return EXIT_SUCCESS;
+	}
+	if (!waveModel->init() || !terrainInit())
+		return EXIT_FAILURE;
+	if (terrainPager.bakeFilename)
+		return terrainPagerBake() ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (!terrainPyramidInit() || !worldInit())
+		return EXIT_FAILURE;
+	if (bench.rayCasts > 0) {
+		benchRayCasts(bench.rayCasts);
+		return EXIT_SUCCESS;
+	}
+	if (bench.jobFrames > 0) {
+		benchJobs(bench.jobFrames);
+		return EXIT_SUCCESS;
+	}
+	if (headless.enabled)
+		return headlessRun() ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (bench.renderFrames > 0 && offscreenContext()) {
+		if (!init())
+			return EXIT_FAILURE;
+		return benchRender(bench.renderFrames) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	glutInit(&argc, argv);
 	glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
 	glutInitWindowPosition(0, 0);
@@ -1831,13 +7085,25 @@ int main(int argc, char **argv) {
 	glutCreateWindow("Island Defender v1.0");
 	if (!init())
 		return EXIT_FAILURE;
+	if (bench.seaShadingFrames > 0) {
+		reshape(800, 600);
+		benchSeaShading(bench.seaShadingFrames);
+		return EXIT_SUCCESS;
+	}
+	// without a pbuffer the benchmark draws in the window
+	if (bench.renderFrames > 0)
+		return benchRender(bench.renderFrames) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (metrics.filename && !metricsOpen())
+		return EXIT_FAILURE;
+	if (sim.enabled && !simStart())
+		return EXIT_FAILURE;
 	glutKeyboardFunc(keyboard);
 	glutSpecialFunc(specialKey);
 	glutMouseFunc(mouse);
 	glutMotionFunc(mouseMotion);
 	glutDisplayFunc(display);
 	glutReshapeFunc(reshape);
-	glutIdleFunc(update);
+	glutIdleFunc(sim.thread ? simIdle : update);
 	glutMainLoop();
 	return EXIT_SUCCESS;
 }